@@ -23,6 +23,13 @@ struct FrameSize
     unsigned height;
 };
 
+/*! An area of a frame, used to report the parts that changed */
+struct DamageRect
+{
+    int x, y;
+    unsigned width, height;
+};
+
 struct FrameInfo
 {
     FrameSize size;
@@ -71,6 +78,18 @@ protected:
     void operator=(const FrameCapture&) = delete;
 };
 
+/*!
+ * Implemented by the captures which keep capturing in the background.
+ * The agent keeps the capture of a stopped stream for the next one and
+ * pauses it meanwhile, FrameCapture::Reset resumes it.
+ */
+class PausableCapture
+{
+public:
+    virtual ~PausableCapture() = default;
+    virtual void Pause() = 0;
+};
+
 }} // namespace spice::streaming_agent
 
 #endif // SPICE_STREAMING_AGENT_FRAME_CAPTURE_HPP
@@ -0,0 +1,113 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_FRAME_PACER_HPP
+#define SPICE_STREAMING_AGENT_FRAME_PACER_HPP
+
+#include <cstdint>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * Counters of a FramePacer.
+ */
+struct FramePacerStats
+{
+    /// number of deadlines waited for
+    uint64_t frames = 0;
+    /// deadlines that had already passed when wait() was called
+    uint64_t missed = 0;
+    /// frame periods dropped from the schedule to catch up
+    uint64_t skipped = 0;
+    /// sum and maximum of the delays between the deadlines and the actual
+    /// wake up times, in nanoseconds
+    uint64_t total_jitter_ns = 0;
+    uint64_t max_jitter_ns = 0;
+};
+
+/**
+ * The time source of a FramePacer, the default one is CLOCK_MONOTONIC.
+ * Tests provide their own clock to control the time.
+ */
+class FramePacerClock
+{
+public:
+    virtual ~FramePacerClock() = default;
+
+    /**
+     * @return the current time, in nanoseconds
+     */
+    virtual uint64_t now_ns() = 0;
+
+    /**
+     * Sleeps until @deadline_ns, in nanoseconds of now_ns().
+     */
+    virtual void sleep_until(uint64_t deadline_ns) = 0;
+};
+
+/**
+ * Paces a capture loop at a fixed frame rate.
+ *
+ * The deadlines are absolute times on CLOCK_MONOTONIC, one frame period
+ * apart, so the time spent capturing and encoding does not make the rate
+ * drift. When the caller falls behind by one frame period or more, the late
+ * frame is produced right away and the schedule skips ahead to the next
+ * deadline in the future instead of producing a burst of frames.
+ *
+ * The object is not thread safe.
+ */
+class FramePacer
+{
+public:
+    /**
+     * @param fps the frame rate, at least 1
+     * @param clock the time source, CLOCK_MONOTONIC if null, it must
+     * outlive the pacer
+     */
+    explicit FramePacer(unsigned fps, FramePacerClock *clock=nullptr);
+
+    /**
+     * Changes the frame rate, the schedule restarts with the next wait().
+     */
+    void set_fps(unsigned fps);
+
+    /**
+     * Sleeps until the next deadline. The first call returns immediately.
+     *
+     * @return the deadline, in nanoseconds of the clock
+     */
+    uint64_t wait();
+
+    /**
+     * To be called when the caller blocked on something else than the pacer,
+     * for instance waiting for the screen to change, before producing a
+     * frame. If the next deadline already passed, the schedule restarts one
+     * period from now and the deadline is not reported as missed.
+     */
+    void resync();
+
+    /**
+     * Restarts the schedule with the next wait(), keeping the statistics.
+     */
+    void reset();
+
+    const FramePacerStats &stats() const { return counters; }
+
+    /**
+     * @return the current time of CLOCK_MONOTONIC, in nanoseconds
+     */
+    static uint64_t now_ns();
+
+private:
+    FramePacerClock *clock;
+    uint64_t period_ns;
+    uint64_t next_deadline = 0;
+    FramePacerStats counters;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_PACER_HPP
@@ -0,0 +1,105 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_PIXEL_FORMAT_HPP
+#define SPICE_STREAMING_AGENT_PIXEL_FORMAT_HPP
+
+#include <spice-streaming-agent/simd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * The layout of the pixels of a captured frame, as described by an XImage.
+ */
+struct PixelFormat
+{
+    unsigned depth;
+    unsigned bits_per_pixel;
+    /// the bytes of a pixel are stored most significant first
+    bool big_endian;
+    uint32_t red_mask;
+    uint32_t green_mask;
+    uint32_t blue_mask;
+
+    /**
+     * @return the usual 32 bits TrueColor format, the bytes of a pixel
+     * being blue, green, red and padding
+     */
+    static PixelFormat bgrx()
+    {
+        return { 24, 32, false, 0xff0000, 0xff00, 0xff };
+    }
+
+    /**
+     * @return true if the pixels are stored as blue, green, red and padding
+     * bytes, the format libjpeg-turbo reads without conversion
+     */
+    bool is_bgrx() const;
+
+    bool operator==(const PixelFormat &other) const;
+    bool operator!=(const PixelFormat &other) const { return !(*this == other); }
+};
+
+/**
+ * Converts frames of a given PixelFormat to packed 24 bits RGB (red first),
+ * the layout any JPEG encoder accepts.
+ *
+ * The 32 bits BGRX, 16 bits RGB565 and 24 bits packed formats are converted
+ * by SIMD kernels, the other TrueColor formats (other masks, other byte
+ * order) by a generic scalar one.
+ */
+class PixelConverter
+{
+public:
+    /**
+     * Throws an Error if @format is not a 16, 24 or 32 bits TrueColor format.
+     *
+     * @param kernel the kernel to use, an unsupported kernel is replaced by
+     * the best supported one
+     */
+    explicit PixelConverter(const PixelFormat &format,
+                            SimdLevel kernel=SimdLevel::Best);
+
+    /**
+     * Converts @width pixels from @src to 3 * @width bytes at @dst.
+     */
+    void convert_line(const uint8_t *src, uint8_t *dst, unsigned width) const
+    {
+        line_function(src, dst, width, pixel_format);
+    }
+
+    /**
+     * Converts a frame to @dst, whose lines are 3 * @width bytes long.
+     *
+     * @param stride the distance between two lines of @src, in bytes
+     */
+    void convert(const uint8_t *src, size_t stride, uint8_t *dst,
+                 unsigned width, unsigned height) const;
+
+    const PixelFormat &format() const { return pixel_format; }
+    SimdLevel kernel() const { return kernel_used; }
+
+    /**
+     * @return the kernel converting when @kernel is requested, there are
+     * SSSE3 and AVX2 ones (BGRX only for AVX2)
+     */
+    static SimdLevel supported_kernel(SimdLevel kernel);
+
+private:
+    typedef void LineFunction(const uint8_t *src, uint8_t *dst, unsigned width,
+                              const PixelFormat &format);
+
+    const PixelFormat pixel_format;
+    const SimdLevel kernel_used;
+    LineFunction *line_function;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_PIXEL_FORMAT_HPP
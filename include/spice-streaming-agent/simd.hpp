@@ -0,0 +1,45 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_SIMD_HPP
+#define SPICE_STREAMING_AGENT_SIMD_HPP
+
+#include <initializer_list>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * The instruction sets the SIMD kernels are written for, in increasing
+ * order. The kernels of a module all produce the same result, they only
+ * differ in speed; each module implements some of the levels.
+ */
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    /// the fastest level supported by the CPU
+    Best,
+};
+
+/**
+ * @return whether the CPU supports @level, Scalar and Best always are
+ */
+bool cpu_supports(SimdLevel level);
+
+/**
+ * Chooses the kernel of a module.
+ *
+ * @param implemented the levels the module has a kernel for, besides Scalar
+ * @return the highest of @implemented up to @requested that the CPU
+ * supports, Scalar if there is none
+ */
+SimdLevel select_simd_level(SimdLevel requested, std::initializer_list<SimdLevel> implemented);
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_SIMD_HPP
@@ -0,0 +1,97 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_TILE_HASH_HPP
+#define SPICE_STREAMING_AGENT_TILE_HASH_HPP
+
+#include <spice-streaming-agent/frame-capture.hpp>
+#include <spice-streaming-agent/simd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * Detects the changes between consecutive frames in software, for the
+ * cases where XDamage is not available or not reliable.
+ *
+ * The frame, a 32 bits per pixel buffer, is split into square tiles, each
+ * tile is hashed and compared to the hash of the same tile in the previous
+ * frame.
+ */
+class TileChangeDetector
+{
+public:
+    /**
+     * Throws an Error if @tile_size is not a non null multiple of 8.
+     *
+     * @param tile_size width and height of the tiles, in pixels
+     * @param kernel the hashing kernel to use, an unsupported kernel is
+     * replaced by the best supported one
+     */
+    TileChangeDetector(unsigned tile_size=64, SimdLevel kernel=SimdLevel::Best);
+
+    /**
+     * Hashes the tiles of a new frame and compares them to the previous frame.
+     * All the tiles are reported as changed for the first frame and after a
+     * change of the frame size.
+     *
+     * @param data the frame pixels, 4 bytes per pixel
+     * @param stride the distance between two lines, in bytes
+     * @return the number of tiles that changed
+     */
+    size_t update(const uint8_t *data, unsigned width, unsigned height, size_t stride);
+
+    /**
+     * Forgets the previous frame, the next update() reports all tiles changed.
+     */
+    void reset();
+
+    /**
+     * @return true if the tile at @column, @row changed in the last update()
+     */
+    bool tile_changed(unsigned column, unsigned row) const
+    {
+        return changed[row * cols + column] != 0;
+    }
+
+    /**
+     * @return the changed area as rectangles, adjacent changed tiles of a
+     * row of tiles are merged in a single rectangle
+     */
+    std::vector<DamageRect> changed_rects() const;
+
+    unsigned columns() const { return cols; }
+    unsigned rows() const { return tile_rows; }
+    unsigned tile_size() const { return size; }
+    SimdLevel kernel() const { return kernel_used; }
+
+    /**
+     * Hashes a single area of a frame with the given kernel.
+     */
+    static uint64_t hash_area(const uint8_t *data, unsigned width, unsigned height,
+                              size_t stride, SimdLevel kernel=SimdLevel::Best);
+
+    /**
+     * @return the kernel hashing when @kernel is requested, there are SSE2
+     * and AVX2 ones
+     */
+    static SimdLevel supported_kernel(SimdLevel kernel);
+
+private:
+    const unsigned size;
+    const SimdLevel kernel_used;
+    unsigned width = 0, height = 0;
+    unsigned cols = 0, tile_rows = 0;
+    std::vector<uint64_t> hashes;
+    std::vector<uint8_t> changed;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_TILE_HASH_HPP
@@ -0,0 +1,91 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_X11_DAMAGE_HPP
+#define SPICE_STREAMING_AGENT_X11_DAMAGE_HPP
+
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * Tracks the areas of an X window that changed, using the XDamage extension.
+ *
+ * The tracker starts in the damaged state so that the first frame is always
+ * captured. A typical capture loop calls wait_for_damage(), then
+ * take_damage() right before reading the window content, so that any change
+ * happening during the capture is reported for the next frame.
+ *
+ * The tracker uses the event queue of @display, the caller should not select
+ * other events on the same connection. The object must be destroyed before
+ * the display is closed.
+ */
+class X11DamageTracker
+{
+public:
+    /**
+     * Throws an Error if the XDamage extension is not available.
+     */
+    X11DamageTracker(Display *display, Window window);
+    X11DamageTracker(const X11DamageTracker &) = delete;
+    X11DamageTracker &operator=(const X11DamageTracker &) = delete;
+    ~X11DamageTracker();
+
+    /**
+     * Processes the pending events without blocking.
+     *
+     * @return true if the window was damaged since the last take_damage()
+     */
+    bool damaged();
+
+    /**
+     * Waits until the window gets damaged or @timeout_ms milliseconds
+     * elapsed. A negative timeout waits forever. The wait also ends early
+     * when the wakeup descriptor gets readable or a signal arrives.
+     *
+     * @return true if the window was damaged since the last take_damage()
+     */
+    bool wait_for_damage(int timeout_ms);
+
+    /**
+     * Sets the descriptor ending the waits of all the trackers when it gets
+     * readable, the agent passes the stream port so that its commands are
+     * not delayed by a static screen. -1 for none.
+     */
+    static void set_wakeup_fd(int fd);
+
+    /**
+     * Fetches and clears the damage accumulated since the previous call.
+     *
+     * @return the damaged rectangles, also available through damage() until
+     * the next call
+     */
+    const std::vector<DamageRect> &take_damage();
+
+    /**
+     * @return the rectangles returned by the last take_damage()
+     */
+    const std::vector<DamageRect> &damage() const { return rects; }
+
+private:
+    void process_events();
+
+    Display *const display;
+    int damage_event_base;
+    Damage damage_handle;
+    XserverRegion region;
+    bool pending = true;
+    std::vector<DamageRect> rects;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_X11_DAMAGE_HPP
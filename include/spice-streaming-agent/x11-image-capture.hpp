@@ -0,0 +1,67 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_X11_IMAGE_CAPTURE_HPP
+#define SPICE_STREAMING_AGENT_X11_IMAGE_CAPTURE_HPP
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * Grabs the content of an X window into an XImage.
+ *
+ * When the X server supports the MIT-SHM extension and the segment can be
+ * attached (it cannot for a remote X server) the image is read with
+ * XShmGetImage into a shared memory segment which is kept across captures
+ * and only rebuilt when the captured size changes. Otherwise every capture
+ * falls back to XGetImage.
+ *
+ * The object must be destroyed before the display is closed.
+ */
+class X11ImageCapture
+{
+public:
+    /**
+     * @param display the X display to capture from, must not be null
+     * @param use_shm set to false to never try the MIT-SHM extension
+     */
+    X11ImageCapture(Display *display, bool use_shm=true);
+    X11ImageCapture(const X11ImageCapture &) = delete;
+    X11ImageCapture &operator=(const X11ImageCapture &) = delete;
+    ~X11ImageCapture();
+
+    /**
+     * Captures an area of @window.
+     *
+     * Throws an Error if the image cannot be read from the X server.
+     *
+     * @return the captured image, owned by this object and valid until the
+     * next call to capture() or the destruction of the object
+     */
+    XImage *capture(Window window, int x, int y, unsigned width, unsigned height);
+
+    /**
+     * @return true if the captures are done through shared memory
+     */
+    bool uses_shm() const { return use_shm; }
+
+private:
+    bool create_shm_image(Window window, unsigned width, unsigned height);
+    void destroy_image();
+
+    Display *const display;
+    bool use_shm;
+    bool image_is_shm = false;
+    XImage *image = nullptr;
+    XShmSegmentInfo shm_info = {};
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_X11_IMAGE_CAPTURE_HPP
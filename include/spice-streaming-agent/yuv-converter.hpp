@@ -0,0 +1,113 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_YUV_CONVERTER_HPP
+#define SPICE_STREAMING_AGENT_YUV_CONVERTER_HPP
+
+#include <spice-streaming-agent/simd.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace spice __attribute__ ((visibility ("default"))) {
+namespace streaming_agent {
+
+/**
+ * The YUV 4:2:0 formats the video encoders take as input.
+ */
+enum class YuvFormat
+{
+    /// Y plane, then U plane, then V plane
+    I420,
+    /// Y plane, then a plane of interleaved U and V samples
+    NV12,
+};
+
+/**
+ * The planes of a converted frame within its buffer, laid out like the
+ * default GStreamer video layout: the lines are padded to 4 bytes and the
+ * planes follow each other.
+ */
+struct YuvLayout
+{
+    size_t size;
+    /// Y, U and V planes, the V plane is not used by NV12
+    size_t offsets[3];
+    size_t strides[3];
+
+    static YuvLayout compute(YuvFormat format, unsigned width, unsigned height);
+};
+
+/**
+ * Converts 32 bits BGRX frames to YUV 4:2:0 (BT.601, limited range), each
+ * chroma sample being the average of a 2x2 block of pixels.
+ *
+ * The frame is split into bands of lines converted in parallel, the calling
+ * thread converts bands too, threads - 1 workers are started.
+ */
+class YuvConverter
+{
+public:
+    /**
+     * @param kernel the kernel to use, an unsupported kernel is replaced by
+     * the best supported one
+     */
+    explicit YuvConverter(YuvFormat format, unsigned threads=1,
+                          SimdLevel kernel=SimdLevel::Best);
+    YuvConverter(const YuvConverter &) = delete;
+    YuvConverter &operator=(const YuvConverter &) = delete;
+    ~YuvConverter();
+
+    /**
+     * Converts a frame to @dst, laid out as YuvLayout::compute tells.
+     * Throws an Error if @width or @height is odd.
+     *
+     * @param stride the distance between two lines of @src, in bytes
+     */
+    void convert(const uint8_t *src, size_t stride, unsigned width, unsigned height,
+                 uint8_t *dst);
+
+    YuvFormat format() const { return yuv_format; }
+    SimdLevel kernel() const { return kernel_used; }
+    unsigned threads() const { return workers.size() + 1; }
+
+    /**
+     * @return the kernel converting when @kernel is requested, there are
+     * SSE2 and AVX2 ones
+     */
+    static SimdLevel supported_kernel(SimdLevel kernel);
+
+private:
+    void worker();
+    void convert_bands();
+
+    const YuvFormat yuv_format;
+    const SimdLevel kernel_used;
+
+    // the frame being converted
+    const uint8_t *src = nullptr;
+    size_t stride = 0;
+    unsigned width = 0, height = 0;
+    uint8_t *dst = nullptr;
+    YuvLayout layout = {};
+    unsigned bands = 0;
+    std::atomic<unsigned> next_band;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cond, done_cond;
+    uint64_t generation = 0;
+    unsigned busy_workers = 0;
+    bool stopping = false;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_YUV_CONVERTER_HPP
@@ -0,0 +1,83 @@
+/* Benchmark of the frame downscaling, and of the JPEG encoding it saves.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+
+#include "frame-scaler.hpp"
+#include "jpeg.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+using namespace spice::streaming_agent::bench;
+
+int main()
+{
+    const Resolution &resolution = screen_resolutions.back();
+    const unsigned width = resolution.width, height = resolution.height;
+    const std::vector<uint8_t> frame = make_frame(Content::Photo, width, height);
+
+    const std::pair<ssa::SimdLevel, const char *> kernels[] = {
+        {ssa::SimdLevel::Scalar, "scalar"},
+        {ssa::SimdLevel::SSE2, "sse2"},
+    };
+
+    JsonReport report("frame-scaler");
+    std::vector<uint8_t> scaled, jpeg;
+    JpegEncoder encoder;
+    for (unsigned factor : {1u, 2u, 3u}) {
+        const unsigned out_width = width / factor, out_height = height / factor;
+        scaled.resize(out_width * out_height * 4);
+
+        for (const auto &kernel : kernels) {
+            if (factor == 1) {
+                break;
+            }
+            // only the factor 2 has an SSE2 kernel
+            const bool simd = kernel.first != ssa::SimdLevel::Scalar;
+            if (simd && (factor != 2 || ssa::supported_scale_kernel(kernel.first) != kernel.first)) {
+                continue;
+            }
+
+            Timing timing = measure([&] {
+                ssa::downscale_frame(frame.data(), width * 4, width, height, factor,
+                                     scaled.data(), kernel.first);
+            });
+
+            report.add({
+                {"step", JsonReport::quote("downscale")},
+                {"kernel", JsonReport::quote(kernel.second)},
+                {"factor", JsonReport::number((uint64_t) factor)},
+                {"width", JsonReport::number((uint64_t) width)},
+                {"height", JsonReport::number((uint64_t) height)},
+                {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+                {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+                {"best_ns", JsonReport::number(timing.best_ns)},
+            });
+        }
+
+        const uint8_t *data = frame.data();
+        if (factor > 1) {
+            ssa::downscale_frame(frame.data(), width * 4, width, height, factor, scaled.data());
+            data = scaled.data();
+        }
+        Timing timing = measure([&] {
+            encoder.encode(jpeg, 80, data, out_width, out_height);
+        });
+
+        report.add({
+            {"step", JsonReport::quote("encode")},
+            {"factor", JsonReport::number((uint64_t) factor)},
+            {"width", JsonReport::number((uint64_t) out_width)},
+            {"height", JsonReport::number((uint64_t) out_height)},
+            {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+            {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+            {"best_ns", JsonReport::number(timing.best_ns)},
+            {"bytes", JsonReport::number((uint64_t) jpeg.size())},
+        });
+    }
+
+    return 0;
+}
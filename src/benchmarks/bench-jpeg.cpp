@@ -0,0 +1,126 @@
+/* Benchmark of the MJPEG encoding of screen-like frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+#include "jpeg.hpp"
+
+#include <algorithm>
+
+
+namespace ssa = spice::streaming_agent;
+using namespace spice::streaming_agent::bench;
+
+int main()
+{
+    const int qualities[] = { 50, 80, 95 };
+
+    // the per-frame setup of write_JPEG_file shows on small frames
+    std::vector<Resolution> resolutions = { {"256x256", 256, 256} };
+    resolutions.insert(resolutions.end(), screen_resolutions.begin(), screen_resolutions.end());
+
+    JpegEncoder encoder;
+    ParallelJpegEncoder parallel_encoder(std::max(2u, std::thread::hardware_concurrency()));
+    const std::string parallel_name =
+        "ParallelJpegEncoder(" + std::to_string(parallel_encoder.threads()) + ")";
+    std::vector<uint8_t> output;
+    ssa::SegmentedBuffer segments(std::make_shared<ssa::BlockPool>());
+    // the encoders return the size of the JPEG image
+    const std::pair<std::string, std::function<size_t(int, uint8_t *, unsigned, unsigned)>> encoders[] = {
+        {"write_JPEG_file", [&output](int quality, uint8_t *data, unsigned width, unsigned height) {
+            write_JPEG_file(output, quality, data, width, height);
+            return output.size();
+        }},
+        {"JpegEncoder", [&](int quality, uint8_t *data, unsigned width, unsigned height) {
+            encoder.encode(output, quality, data, width, height);
+            return output.size();
+        }},
+        {"JpegEncoder(segmented)", [&](int quality, uint8_t *data, unsigned width,
+                                       unsigned height) {
+            encoder.encode(segments, quality, data, width, height);
+            return segments.size();
+        }},
+        {parallel_name, [&](int quality, uint8_t *data, unsigned width, unsigned height) {
+            parallel_encoder.encode(output, quality, data, width, height);
+            return output.size();
+        }},
+        {parallel_name + "(segmented)", [&](int quality, uint8_t *data, unsigned width,
+                                            unsigned height) {
+            parallel_encoder.encode(segments, quality, data, width, height);
+            return segments.size();
+        }},
+    };
+
+    JsonReport report("jpeg");
+    for (const auto &resolution : resolutions) {
+        for (Content content : all_contents) {
+            std::vector<uint8_t> frame = make_frame(content, resolution.width, resolution.height);
+            for (int quality : qualities) {
+                for (const auto &encode : encoders) {
+                    output = std::vector<uint8_t>();
+                    size_t size = 0;
+                    Timing timing = measure([&] {
+                        size = encode.second(quality, frame.data(),
+                                             resolution.width, resolution.height);
+                    }, 3, 200000000u);
+
+                    report.add({
+                        {"encoder", JsonReport::quote(encode.first)},
+                        {"resolution", JsonReport::quote(resolution.name)},
+                        {"width", JsonReport::number((uint64_t) resolution.width)},
+                        {"height", JsonReport::number((uint64_t) resolution.height)},
+                        {"content", JsonReport::quote(content_name(content))},
+                        {"quality", JsonReport::number((uint64_t) quality)},
+                        {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+                        {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+                        {"best_ns", JsonReport::number(timing.best_ns)},
+                        {"mb_per_s", JsonReport::number(frame.size() * 1000.0 / timing.mean_ns)},
+                        {"bytes", JsonReport::number((uint64_t) size)},
+                    });
+                }
+            }
+        }
+    }
+
+    // the stripe cache on 1080p frames: a static screen where every stripe
+    // is reused, and a screen changing completely, where hashing and the
+    // shorter stripes are pure overhead
+    const Resolution &full_hd = screen_resolutions[1];
+    for (Content content : all_contents) {
+        std::vector<uint8_t> frames[2];
+        frames[0] = make_frame(content, full_hd.width, full_hd.height);
+        frames[1] = frames[0];
+        for (auto &byte : frames[1]) {
+            byte ^= 0x10;
+        }
+        for (unsigned stripe_height : {0u, 16u, 32u, 64u}) {
+            for (bool changing : {false, true}) {
+                ParallelJpegEncoder cached_encoder(1);
+                cached_encoder.set_stripe_cache(stripe_height);
+                std::vector<uint8_t> output;
+                unsigned frame_index = 0;
+                Timing timing = measure([&] {
+                    std::vector<uint8_t> &frame = frames[changing ? frame_index++ % 2 : 0];
+                    cached_encoder.encode(output, 80, frame.data(), full_hd.width, full_hd.height);
+                }, 3, 200000000u);
+
+                report.add({
+                    {"encoder", JsonReport::quote("ParallelJpegEncoder(1)")},
+                    {"stripe_cache", JsonReport::number((uint64_t) stripe_height)},
+                    {"screen", JsonReport::quote(changing ? "changing" : "static")},
+                    {"resolution", JsonReport::quote(full_hd.name)},
+                    {"content", JsonReport::quote(content_name(content))},
+                    {"quality", JsonReport::number((uint64_t) 80)},
+                    {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+                    {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+                    {"best_ns", JsonReport::number(timing.best_ns)},
+                    {"bytes", JsonReport::number((uint64_t) output.size())},
+                });
+            }
+        }
+    }
+
+    return 0;
+}
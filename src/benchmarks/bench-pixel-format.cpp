@@ -0,0 +1,69 @@
+/* Benchmark of the pixel format conversion kernels.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+
+#include <spice-streaming-agent/pixel-format.hpp>
+
+#include <random>
+
+
+namespace ssa = spice::streaming_agent;
+using namespace spice::streaming_agent::bench;
+
+int main()
+{
+    const unsigned width = 1920, height = 1080;
+
+    const std::pair<ssa::PixelFormat, const char *> formats[] = {
+        { ssa::PixelFormat::bgrx(), "bgrx" },
+        { { 16, 16, false, 0xf800, 0x07e0, 0x001f }, "rgb565" },
+        { { 24, 24, false, 0xff0000, 0xff00, 0xff }, "bgr24" },
+        { { 24, 32, true, 0xff0000, 0xff00, 0xff }, "xrgb-big-endian" },
+    };
+    const std::pair<ssa::SimdLevel, const char *> kernels[] = {
+        {ssa::SimdLevel::Scalar, "scalar"},
+        {ssa::SimdLevel::SSSE3, "ssse3"},
+        {ssa::SimdLevel::AVX2, "avx2"},
+    };
+
+    std::mt19937 generator(42);
+    std::vector<uint8_t> rgb(width * height * 3);
+
+    JsonReport report("pixel-format");
+    for (const auto &format : formats) {
+        const size_t stride = width * format.first.bits_per_pixel / 8;
+        std::vector<uint8_t> frame(stride * height);
+        for (auto &byte : frame) {
+            byte = generator();
+        }
+
+        for (const auto &kernel : kernels) {
+            ssa::PixelConverter converter(format.first, kernel.first);
+            // formats without this kernel use a slower one, already measured
+            if (converter.kernel() != kernel.first) {
+                continue;
+            }
+
+            Timing timing = measure([&] {
+                converter.convert(frame.data(), stride, rgb.data(), width, height);
+            });
+
+            report.add({
+                {"format", JsonReport::quote(format.second)},
+                {"kernel", JsonReport::quote(kernel.second)},
+                {"width", JsonReport::number((uint64_t) width)},
+                {"height", JsonReport::number((uint64_t) height)},
+                {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+                {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+                {"best_ns", JsonReport::number(timing.best_ns)},
+                {"mpixels_per_s", JsonReport::number(width * height * 1000.0 / timing.mean_ns)},
+            });
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* Benchmark of the tile hash change detection kernels.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+
+#include <spice-streaming-agent/tile-hash.hpp>
+
+#include <random>
+
+
+namespace ssa = spice::streaming_agent;
+using namespace spice::streaming_agent::bench;
+
+int main()
+{
+    const unsigned width = 1920, height = 1080;
+    const size_t stride = width * 4;
+
+    // two different frames so that the hashed data does not stay in the cache
+    std::mt19937 generator(42);
+    std::vector<uint8_t> frames[2];
+    for (auto &frame : frames) {
+        frame.resize(stride * height);
+        for (auto &byte : frame) {
+            byte = generator();
+        }
+    }
+
+    const std::pair<ssa::SimdLevel, const char *> kernels[] = {
+        {ssa::SimdLevel::Scalar, "scalar"},
+        {ssa::SimdLevel::SSE2, "sse2"},
+        {ssa::SimdLevel::AVX2, "avx2"},
+    };
+
+    JsonReport report("tile-hash");
+    for (const auto &kernel : kernels) {
+        if (ssa::TileChangeDetector::supported_kernel(kernel.first) != kernel.first) {
+            continue;
+        }
+
+        ssa::TileChangeDetector detector(64, kernel.first);
+        unsigned i = 0;
+        Timing timing = measure([&] {
+            detector.update(frames[i++ % 2].data(), width, height, stride);
+        });
+
+        report.add({
+            {"kernel", JsonReport::quote(kernel.second)},
+            {"width", JsonReport::number((uint64_t) width)},
+            {"height", JsonReport::number((uint64_t) height)},
+            {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+            {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+            {"best_ns", JsonReport::number(timing.best_ns)},
+            {"mb_per_s", JsonReport::number(stride * height * 1000.0 / timing.mean_ns)},
+        });
+    }
+
+    return 0;
+}
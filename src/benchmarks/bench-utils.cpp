@@ -0,0 +1,194 @@
+/* Helpers shared by the benchmarks: timing, synthetic frames and JSON output.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <time.h>
+
+
+namespace spice {
+namespace streaming_agent {
+namespace bench {
+
+uint64_t get_time_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+const std::vector<Resolution> screen_resolutions = {
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440},
+    {"4k", 3840, 2160},
+};
+
+const std::vector<Content> all_contents = {
+    Content::Solid,
+    Content::Text,
+    Content::Gradient,
+    Content::Photo,
+};
+
+const char *content_name(Content content)
+{
+    switch (content) {
+    case Content::Solid:
+        return "solid";
+    case Content::Text:
+        return "text";
+    case Content::Gradient:
+        return "gradient";
+    case Content::Photo:
+        return "photo";
+    }
+    return "unknown";
+}
+
+static inline void put_pixel(uint8_t *p, unsigned r, unsigned g, unsigned b)
+{
+    p[0] = b;
+    p[1] = g;
+    p[2] = r;
+    p[3] = 0;
+}
+
+std::vector<uint8_t> make_frame(Content content, unsigned width, unsigned height)
+{
+    std::vector<uint8_t> frame(width * height * 4);
+    std::mt19937 generator(1234);
+
+    switch (content) {
+    case Content::Solid:
+        for (size_t i = 0; i < frame.size(); i += 4) {
+            put_pixel(&frame[i], 0x2e, 0x34, 0x40);
+        }
+        break;
+    case Content::Text: {
+        // lines of 8x16 "glyphs" made of random strokes, like a terminal
+        for (size_t i = 0; i < frame.size(); i += 4) {
+            put_pixel(&frame[i], 0xf6, 0xf5, 0xf4);
+        }
+        for (unsigned y = 8; y + 16 <= height; y += 20) {
+            for (unsigned x = 8; x + 8 <= width; x += 9) {
+                const uint32_t glyph = generator();
+                if ((glyph & 0x1f) == 0) {
+                    continue; // a space
+                }
+                for (unsigned gy = 0; gy < 16; ++gy) {
+                    for (unsigned gx = 0; gx < 8; ++gx) {
+                        const bool stroke = (gx == (glyph >> 8) % 8) || (gy == (glyph >> 12) % 16) ||
+                                            ((glyph >> 16) & 1 && gx == gy / 2);
+                        if (stroke) {
+                            put_pixel(&frame[((y + gy) * width + x + gx) * 4], 0x24, 0x1f, 0x31);
+                        }
+                    }
+                }
+            }
+        }
+        break;
+    }
+    case Content::Gradient:
+        for (unsigned y = 0; y < height; ++y) {
+            for (unsigned x = 0; x < width; ++x) {
+                put_pixel(&frame[(y * width + x) * 4],
+                          x * 255 / width, y * 255 / height, 255 - x * 255 / width);
+            }
+        }
+        break;
+    case Content::Photo: {
+        // low frequency shapes plus sensor-like noise
+        std::uniform_int_distribution<int> noise(-12, 12);
+        for (unsigned y = 0; y < height; ++y) {
+            for (unsigned x = 0; x < width; ++x) {
+                const double fx = x * 6.0 / width, fy = y * 4.0 / height;
+                const double base = 0.5 + 0.25 * std::sin(fx * 2.1 + std::cos(fy * 1.3)) +
+                                    0.25 * std::sin(fy * 3.7 - fx);
+                auto channel = [&](double scale) {
+                    return (unsigned) std::min(255, std::max(0, (int) (base * scale) + noise(generator)));
+                };
+                put_pixel(&frame[(y * width + x) * 4], channel(230), channel(190), channel(150));
+            }
+        }
+        break;
+    }
+    }
+
+    return frame;
+}
+
+Timing measure(const std::function<void()> &run, unsigned min_iterations, uint64_t min_time_ns)
+{
+    run(); // warm up the caches and the allocations
+
+    Timing timing = {0, 0, UINT64_MAX};
+    uint64_t total = 0;
+    while (timing.iterations < min_iterations || total < min_time_ns) {
+        const uint64_t start = get_time_ns();
+        run();
+        const uint64_t elapsed = get_time_ns() - start;
+        timing.best_ns = std::min(timing.best_ns, elapsed);
+        total += elapsed;
+        ++timing.iterations;
+    }
+    timing.mean_ns = total / timing.iterations;
+    return timing;
+}
+
+JsonReport::JsonReport(const char *benchmark)
+{
+    printf("{\"benchmark\": %s, \"results\": [", quote(benchmark).c_str());
+}
+
+JsonReport::~JsonReport()
+{
+    printf("\n]}\n");
+}
+
+void JsonReport::add(const std::vector<std::pair<std::string, std::string>> &fields)
+{
+    printf("%s\n  {", first ? "" : ",");
+    first = false;
+    const char *separator = "";
+    for (const auto &field : fields) {
+        printf("%s%s: %s", separator, quote(field.first).c_str(), field.second.c_str());
+        separator = ", ";
+    }
+    printf("}");
+    fflush(stdout);
+}
+
+std::string JsonReport::quote(const std::string &str)
+{
+    std::string quoted = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+std::string JsonReport::number(double value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f", value);
+    return buf;
+}
+
+std::string JsonReport::number(uint64_t value)
+{
+    return std::to_string(value);
+}
+
+}}} // namespace spice::streaming_agent::bench
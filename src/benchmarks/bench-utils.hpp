@@ -0,0 +1,92 @@
+/* Helpers shared by the benchmarks: timing, synthetic frames and JSON output.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_BENCH_UTILS_HPP
+#define SPICE_STREAMING_AGENT_BENCH_UTILS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+namespace bench {
+
+uint64_t get_time_ns();
+
+struct Resolution
+{
+    const char *name;
+    unsigned width, height;
+};
+
+// 720p, 1080p, 1440p and 4K
+extern const std::vector<Resolution> screen_resolutions;
+
+/*
+ * Kinds of synthetic screen content, from the easiest to the hardest to
+ * compress.
+ */
+enum class Content
+{
+    Solid,      ///< a single color
+    Text,       ///< dark glyph-like strokes on a light background
+    Gradient,   ///< smooth horizontal and vertical color ramps
+    Photo,      ///< noisy natural-image-like texture
+};
+
+extern const std::vector<Content> all_contents;
+
+const char *content_name(Content content);
+
+/*
+ * Builds a BGRX frame, 4 bytes per pixel, with a stride of width * 4.
+ * The content is deterministic.
+ */
+std::vector<uint8_t> make_frame(Content content, unsigned width, unsigned height);
+
+struct Timing
+{
+    unsigned iterations;
+    uint64_t mean_ns;
+    uint64_t best_ns;
+};
+
+/*
+ * Runs the function at least min_iterations times and until min_time_ns
+ * elapsed, after a warm up run.
+ */
+Timing measure(const std::function<void()> &run,
+               unsigned min_iterations = 3, uint64_t min_time_ns = 300000000u);
+
+/*
+ * Writes the results as a JSON document on the standard output:
+ * {"benchmark": name, "results": [{...}, ...]}
+ * Each result is a list of key/value pairs, the values being JSON
+ * literals (numbers or already quoted strings).
+ */
+class JsonReport
+{
+public:
+    explicit JsonReport(const char *benchmark);
+    ~JsonReport();
+
+    void add(const std::vector<std::pair<std::string, std::string>> &fields);
+
+    static std::string quote(const std::string &str);
+    static std::string number(double value);
+    static std::string number(uint64_t value);
+
+private:
+    bool first = true;
+};
+
+}}} // namespace spice::streaming_agent::bench
+
+#endif // SPICE_STREAMING_AGENT_BENCH_UTILS_HPP
@@ -0,0 +1,66 @@
+/* Benchmark of the BGRX to YUV conversion kernels.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "bench-utils.hpp"
+
+#include <spice-streaming-agent/yuv-converter.hpp>
+
+#include <algorithm>
+#include <thread>
+
+
+namespace ssa = spice::streaming_agent;
+using namespace spice::streaming_agent::bench;
+
+int main()
+{
+    const unsigned width = 1920, height = 1080;
+    const std::vector<uint8_t> frame = make_frame(Content::Photo, width, height);
+
+    const std::pair<ssa::SimdLevel, const char *> kernels[] = {
+        {ssa::SimdLevel::Scalar, "scalar"},
+        {ssa::SimdLevel::SSE2, "sse2"},
+        {ssa::SimdLevel::AVX2, "avx2"},
+    };
+    const std::pair<ssa::YuvFormat, const char *> formats[] = {
+        {ssa::YuvFormat::I420, "I420"},
+        {ssa::YuvFormat::NV12, "NV12"},
+    };
+    std::vector<unsigned> thread_counts = { 1 };
+    if (std::thread::hardware_concurrency() > 1) {
+        thread_counts.push_back(std::min(std::thread::hardware_concurrency(), 4u));
+    }
+
+    JsonReport report("yuv-converter");
+    for (const auto &kernel : kernels) {
+        if (ssa::YuvConverter::supported_kernel(kernel.first) != kernel.first) {
+            continue;
+        }
+        for (const auto &format : formats) {
+            std::vector<uint8_t> yuv(ssa::YuvLayout::compute(format.first, width, height).size);
+            for (unsigned threads : thread_counts) {
+                ssa::YuvConverter converter(format.first, threads, kernel.first);
+                Timing timing = measure([&] {
+                    converter.convert(frame.data(), width * 4, width, height, yuv.data());
+                });
+
+                report.add({
+                    {"kernel", JsonReport::quote(kernel.second)},
+                    {"format", JsonReport::quote(format.second)},
+                    {"threads", JsonReport::number((uint64_t) threads)},
+                    {"width", JsonReport::number((uint64_t) width)},
+                    {"height", JsonReport::number((uint64_t) height)},
+                    {"iterations", JsonReport::number((uint64_t) timing.iterations)},
+                    {"ns_per_frame", JsonReport::number(timing.mean_ns)},
+                    {"best_ns", JsonReport::number(timing.best_ns)},
+                    {"mpixels_per_s", JsonReport::number(width * height * 1000.0 / timing.mean_ns)},
+                });
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/* A bounded queue to pass items between threads.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_BOUNDED_QUEUE_HPP
+#define SPICE_STREAMING_AGENT_BOUNDED_QUEUE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * What happens when an item is pushed to a full queue
+ */
+enum class OverflowPolicy
+{
+    /// the oldest item is dropped to make room for the new one
+    DropOldest,
+    /// the producer waits until a consumer makes room
+    Block,
+};
+
+/*!
+ * Counters of a BoundedQueue, for statistics
+ */
+struct QueueStats
+{
+    /// items accepted by push()
+    uint64_t pushed = 0;
+    /// items returned by pop()
+    uint64_t popped = 0;
+    /// items discarded because the queue was full
+    uint64_t dropped = 0;
+    /// number of items currently queued
+    size_t occupancy = 0;
+    /// highest number of items queued at once
+    size_t max_occupancy = 0;
+};
+
+/*!
+ * A FIFO queue holding at most a given number of items, shared between
+ * producer and consumer threads.
+ *
+ * Once closed, push() refuses new items and pop() returns the remaining
+ * items then reports the end of the queue; both wake up if they are waiting.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t capacity, OverflowPolicy policy) :
+        capacity(capacity ? capacity : 1),
+        policy(policy)
+    {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    /*!
+     * Adds an item at the end of the queue.
+     * \return false if the queue is closed, the item is not queued
+     */
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (policy == OverflowPolicy::Block) {
+            not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        }
+        if (closed) {
+            return false;
+        }
+        if (items.size() >= capacity) {
+            items.pop_front();
+            ++counters.dropped;
+        }
+        items.push_back(std::move(item));
+        ++counters.pushed;
+        if (items.size() > counters.max_occupancy) {
+            counters.max_occupancy = items.size();
+        }
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    /*!
+     * Removes the first item of the queue, waiting for one if needed.
+     * \return false if the queue is closed and empty
+     */
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        return take(lock, item);
+    }
+
+    /*!
+     * Same as pop() but gives up after \p timeout.
+     * \return false if no item was available in time
+     */
+    template <class Rep, class Period>
+    bool pop_for(T &item, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait_for(lock, timeout, [this] { return closed || !items.empty(); });
+        return take(lock, item);
+    }
+
+    /*!
+     * Removes the first item of the queue if there is one, without waiting.
+     */
+    bool try_pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return take(lock, item);
+    }
+
+    /*!
+     * Closes the queue and wakes up all the waiting threads.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    /*!
+     * Drops all the queued items, they are not counted as dropped.
+     */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.clear();
+        not_full.notify_all();
+    }
+
+    QueueStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        QueueStats result = counters;
+        result.occupancy = items.size();
+        return result;
+    }
+
+private:
+    bool take(std::unique_lock<std::mutex> &lock, T &item)
+    {
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        ++counters.popped;
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    const size_t capacity;
+    const OverflowPolicy policy;
+    mutable std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> items;
+    QueueStats counters;
+    bool closed = false;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_BOUNDED_QUEUE_HPP
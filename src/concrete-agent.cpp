@@ -111,7 +111,8 @@ void ConcreteAgent::LoadPlugin(const std::string &plugin_filename)
     }
 }
 
-FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+std::vector<std::shared_ptr<Plugin>>
+ConcreteAgent::RankPlugins(const std::set<SpiceVideoCodecType>& codecs)
 {
     std::vector<std::pair<unsigned, std::shared_ptr<Plugin>>> sorted_plugins;
 
@@ -121,7 +122,7 @@ FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecT
     }
     sort(sorted_plugins.rbegin(), sorted_plugins.rend());
 
-    // return first not null
+    std::vector<std::shared_ptr<Plugin>> ranked;
     for (const auto& plugin: sorted_plugins) {
         if (plugin.first == DontUse) {
             break;
@@ -129,10 +130,18 @@ FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecT
         // check client supports the codec
         if (codecs.find(plugin.second->VideoCodecType()) == codecs.end())
             continue;
+        ranked.push_back(plugin.second);
+    }
+    return ranked;
+}
 
+FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+{
+    // return first not null
+    for (const auto& plugin: RankPlugins(codecs)) {
         FrameCapture *capture;
         try {
-            capture = plugin.second->CreateCapture();
+            capture = plugin->CreateCapture();
         } catch (const std::exception &err) {
             syslog(LOG_ERR, "Error creating capture engine: %s", err.what());
             continue;
@@ -144,6 +153,34 @@ FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecT
     return nullptr;
 }
 
+void ConcreteAgent::RenewFrameCapture(const std::set<SpiceVideoCodecType>& codecs,
+                                      std::unique_ptr<FrameCapture> &capture)
+{
+    for (const auto& plugin: RankPlugins(codecs)) {
+        if (capture && plugin.get() == capture_plugin) {
+            capture->Reset();
+            return;
+        }
+
+        // the previous capture goes before another one is built, they may
+        // not both hold the display
+        capture.reset();
+        capture_plugin = nullptr;
+        try {
+            capture.reset(plugin->CreateCapture());
+        } catch (const std::exception &err) {
+            syslog(LOG_ERR, "Error creating capture engine: %s", err.what());
+            continue;
+        }
+        if (capture) {
+            capture_plugin = plugin.get();
+            return;
+        }
+    }
+    capture.reset();
+    capture_plugin = nullptr;
+}
+
 void ConcreteAgent::LogStat(const char* format, ...)
 {
     if (logger) {
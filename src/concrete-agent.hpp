@@ -10,6 +10,7 @@
 #include <set>
 #include <memory>
 #include <spice-streaming-agent/plugin.hpp>
+#include <spice-streaming-agent/frame-capture.hpp>
 
 namespace spice {
 namespace streaming_agent {
@@ -34,12 +35,24 @@ public:
     const ConfigureOption* Options() const override;
     void LoadPlugins(const std::string &directory);
     FrameCapture *GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs);
+    /*!
+     * Gives capture, the capture of the previous stream or null, to a new
+     * stream. It is reset and kept if its plugin is still the best one for
+     * codecs, otherwise it is destroyed and the best plugin builds another.
+     * capture is null if no plugin can capture.
+     */
+    void RenewFrameCapture(const std::set<SpiceVideoCodecType>& codecs,
+                           std::unique_ptr<FrameCapture> &capture);
     __attribute__ ((format (printf, 2, 3)))
     void LogStat(const char* format, ...) override;
 private:
     bool PluginVersionIsCompatible(unsigned pluginVersion) const;
     void LoadPlugin(const std::string &plugin_filename);
+    // the usable plugins supporting one of codecs, the best first
+    std::vector<std::shared_ptr<Plugin>> RankPlugins(const std::set<SpiceVideoCodecType>& codecs);
     std::vector<std::shared_ptr<Plugin>> plugins;
+    // the plugin which built the capture RenewFrameCapture gave last
+    const Plugin *capture_plugin = nullptr;
     std::vector<ConcreteConfigureOption> options;
     FrameLog *const logger = nullptr;
 };
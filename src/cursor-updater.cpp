@@ -51,7 +51,7 @@ public:
         return sizeof(PayloadType) + sizeof(uint32_t) * pixels.size();
     }
 
-    void write_message_body(StreamPort &stream_port,
+    void write_message_body(MessageBuffers &buffers,
         uint16_t width, uint16_t height, uint16_t xhot, uint16_t yhot,
         const std::vector<uint32_t> &pixels)
     {
@@ -62,8 +62,8 @@ public:
         msg.hot_spot_x = xhot;
         msg.hot_spot_y = yhot;
 
-        stream_port.write(&msg, sizeof(msg));
-        stream_port.write(pixels.data(), sizeof(uint32_t) * pixels.size());
+        buffers.append_copy(&msg, sizeof(msg));
+        buffers.append(pixels.data(), sizeof(uint32_t) * pixels.size());
     }
 };
 
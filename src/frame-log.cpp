@@ -5,6 +5,7 @@
  */
 
 #include "frame-log.hpp"
+#include "segmented-buffer.hpp"
 
 #include "hexdump.h"
 #include <spice-streaming-agent/error.hpp>
@@ -68,6 +69,20 @@ void FrameLog::log_frame(const void* buffer, size_t buffer_size)
     }
 }
 
+void FrameLog::log_frame(const SegmentedBuffer &frame)
+{
+    if (log_file) {
+        if (log_binary) {
+            for (const auto &iov : frame.iovecs()) {
+                fwrite(iov.iov_base, iov.iov_len, 1, log_file);
+            }
+        } else if (log_frames) {
+            const std::vector<uint8_t> data = frame.to_vector();
+            hexdump(data.data(), data.size(), log_file);
+        }
+    }
+}
+
 /**
  * Returns current time in microseconds.
  */
@@ -15,6 +15,8 @@
 namespace spice {
 namespace streaming_agent {
 
+class SegmentedBuffer;
+
 class FrameLog {
 public:
     FrameLog(const char *log_name, bool log_binary, bool log_frames);
@@ -27,6 +29,7 @@ public:
     __attribute__ ((format (printf, 2, 0)))
     void log_statv(const char* format, va_list ap);
     void log_frame(const void* buffer, size_t buffer_size);
+    void log_frame(const SegmentedBuffer &frame);
 
     static uint64_t get_time();
 
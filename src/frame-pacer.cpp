@@ -0,0 +1,100 @@
+/* Frame pacing on absolute deadlines.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/frame-pacer.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <time.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+class MonotonicClock final : public FramePacerClock
+{
+public:
+    uint64_t now_ns() override
+    {
+        return FramePacer::now_ns();
+    }
+
+    void sleep_until(uint64_t deadline_ns) override
+    {
+        timespec until = { (time_t) (deadline_ns / 1000000000u), (long) (deadline_ns % 1000000000u) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr) == EINTR) {
+        }
+    }
+};
+
+MonotonicClock monotonic_clock;
+
+} // namespace
+
+FramePacer::FramePacer(unsigned fps, FramePacerClock *clock) :
+    clock(clock ? clock : &monotonic_clock)
+{
+    set_fps(fps);
+}
+
+void FramePacer::set_fps(unsigned fps)
+{
+    period_ns = 1000000000u / std::max(fps, 1u);
+    next_deadline = 0;
+}
+
+uint64_t FramePacer::now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+uint64_t FramePacer::wait()
+{
+    uint64_t now = clock->now_ns();
+    if (next_deadline == 0) {
+        next_deadline = now + period_ns;
+        return now;
+    }
+
+    const uint64_t deadline = next_deadline;
+    if (now < deadline) {
+        clock->sleep_until(deadline);
+        now = clock->now_ns();
+    } else {
+        ++counters.missed;
+    }
+
+    const uint64_t jitter = now > deadline ? now - deadline : 0;
+    ++counters.frames;
+    counters.total_jitter_ns += jitter;
+    counters.max_jitter_ns = std::max(counters.max_jitter_ns, jitter);
+
+    // the frames whose period entirely elapsed are not produced at all
+    const uint64_t late_periods = jitter / period_ns;
+    counters.skipped += late_periods;
+    next_deadline = deadline + (late_periods + 1) * period_ns;
+
+    return deadline + late_periods * period_ns;
+}
+
+void FramePacer::resync()
+{
+    const uint64_t now = clock->now_ns();
+    if (next_deadline != 0 && now >= next_deadline) {
+        next_deadline = now + period_ns;
+    }
+}
+
+void FramePacer::reset()
+{
+    next_deadline = 0;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,127 @@
+/* Downscaling of captured frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-scaler.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAME_SCALER_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/*
+ * Any factor: the channels of a line of blocks are summed into
+ * sums, one block line after the other, then rounded to the average.
+ */
+void downscale_scalar(const uint8_t *src, size_t stride, unsigned out_width,
+                      unsigned out_height, unsigned factor, uint8_t *dst)
+{
+    const uint32_t area = factor * factor;
+    std::vector<uint32_t> sums(out_width * 4);
+    for (unsigned y = 0; y < out_height; ++y, dst += out_width * 4) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (unsigned i = 0; i < factor; ++i) {
+            const uint8_t *line = src + ((size_t) y * factor + i) * stride;
+            for (unsigned x = 0; x < out_width; ++x) {
+                uint32_t *sum = &sums[x * 4];
+                for (unsigned j = 0; j < factor; ++j, line += 4) {
+                    sum[0] += line[0];
+                    sum[1] += line[1];
+                    sum[2] += line[2];
+                    sum[3] += line[3];
+                }
+            }
+        }
+        for (unsigned x = 0; x < out_width * 4; ++x) {
+            dst[x] = (sums[x] + area / 2) / area;
+        }
+    }
+}
+
+#if FRAME_SCALER_X86
+// sums the 2x2 blocks of 4 pixels of 2 lines, as 2 pixels of 16 bits channels
+__attribute__((target("sse2")))
+inline __m128i sum_blocks_sse2(__m128i top, __m128i bottom)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+    __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+    // pixels 0 + 1 and 2 + 3 in the low halves
+    left = _mm_add_epi16(left, _mm_unpackhi_epi64(left, left));
+    right = _mm_add_epi16(right, _mm_unpackhi_epi64(right, right));
+    return _mm_unpacklo_epi64(left, right);
+}
+
+// factor 2 only, 4 output pixels at once
+__attribute__((target("sse2")))
+void downscale2_sse2(const uint8_t *src, size_t stride, unsigned out_width,
+                     unsigned out_height, uint8_t *dst)
+{
+    const __m128i rounding = _mm_set1_epi16(2);
+    for (unsigned y = 0; y < out_height; ++y, dst += out_width * 4) {
+        const uint8_t *top = src + (size_t) y * 2 * stride;
+        const uint8_t *bottom = top + stride;
+        unsigned x = 0;
+        for (; x + 4 <= out_width; x += 4) {
+            __m128i a = sum_blocks_sse2(_mm_loadu_si128((const __m128i *) (top + x * 8)),
+                                        _mm_loadu_si128((const __m128i *) (bottom + x * 8)));
+            __m128i b = sum_blocks_sse2(_mm_loadu_si128((const __m128i *) (top + x * 8 + 16)),
+                                        _mm_loadu_si128((const __m128i *) (bottom + x * 8 + 16)));
+            a = _mm_srli_epi16(_mm_add_epi16(a, rounding), 2);
+            b = _mm_srli_epi16(_mm_add_epi16(b, rounding), 2);
+            _mm_storeu_si128((__m128i *) (dst + x * 4), _mm_packus_epi16(a, b));
+        }
+        for (; x < out_width; ++x) {
+            for (unsigned c = 0; c < 4; ++c) {
+                const unsigned sum = top[x * 8 + c] + top[x * 8 + 4 + c] +
+                    bottom[x * 8 + c] + bottom[x * 8 + 4 + c];
+                dst[x * 4 + c] = (sum + 2) / 4;
+            }
+        }
+    }
+}
+#endif
+
+} // namespace
+
+SimdLevel supported_scale_kernel(SimdLevel kernel)
+{
+    return select_simd_level(kernel, {SimdLevel::SSE2});
+}
+
+unsigned downscale_factor(unsigned width, unsigned height, unsigned factor,
+                          unsigned max_width, unsigned max_height)
+{
+    factor = std::max(factor, 1u);
+    while ((max_width && width / factor > max_width) ||
+           (max_height && height / factor > max_height)) {
+        ++factor;
+    }
+    return factor;
+}
+
+void downscale_frame(const uint8_t *src, size_t stride, unsigned width, unsigned height,
+                     unsigned factor, uint8_t *dst, SimdLevel kernel)
+{
+    const unsigned out_width = width / factor, out_height = height / factor;
+#if FRAME_SCALER_X86
+    if (factor == 2 && supported_scale_kernel(kernel) == SimdLevel::SSE2) {
+        downscale2_sse2(src, stride, out_width, out_height, dst);
+        return;
+    }
+#endif
+    downscale_scalar(src, stride, out_width, out_height, factor, dst);
+}
+
+}} // namespace spice::streaming_agent
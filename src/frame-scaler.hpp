@@ -0,0 +1,49 @@
+/* Downscaling of captured frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+#ifndef SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
+#define SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
+
+#include <spice-streaming-agent/simd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * \return the smallest integer factor dividing @width and @height so that
+ * they fit in @max_width x @max_height (0 for no limit), and at least
+ * @factor
+ */
+unsigned downscale_factor(unsigned width, unsigned height, unsigned factor,
+                          unsigned max_width, unsigned max_height);
+
+/*!
+ * Downscales a frame of 32 bits pixels by an integer factor with a box
+ * filter, each channel of an output pixel being the average of a
+ * @factor x @factor block of input pixels. The channels are averaged byte by
+ * byte, so any format with 8 bits channels can be scaled.
+ *
+ * The output is width / factor x height / factor pixels, the last columns
+ * and lines of the input that do not fill a whole block are dropped.
+ *
+ * \param stride the distance between two lines of @src, in bytes
+ * \param dst the output pixels, packed lines of width / factor pixels
+ */
+void downscale_frame(const uint8_t *src, size_t stride, unsigned width, unsigned height,
+                     unsigned factor, uint8_t *dst, SimdLevel kernel=SimdLevel::Best);
+
+/*!
+ * \return the kernel downscaling when @kernel is requested, there is an
+ * SSE2 one for the factor 2
+ */
+SimdLevel supported_scale_kernel(SimdLevel kernel);
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
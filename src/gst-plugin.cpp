@@ -5,23 +5,40 @@
  */
 
 #include <config.h>
+#include <algorithm>
+#include <cinttypes>
 #include <cstring>
 #include <exception>
+#include <fstream>
+#include <future>
+#include <sstream>
 #include <stdexcept>
 #include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <vector>
 #include <syslog.h>
 #include <unistd.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
+// feeds the encoders when probing them, and the pipeline with XLIB_CAPTURE
+#include <gst/app/gstappsrc.h>
 
 #define XLIB_CAPTURE 1
-#if XLIB_CAPTURE
-#include <gst/app/gstappsrc.h>
-#endif
 
 #include <spice-streaming-agent/plugin.hpp>
 #include <spice-streaming-agent/frame-capture.hpp>
 #include <spice-streaming-agent/x11-display-info.hpp>
+#include <spice-streaming-agent/x11-damage.hpp>
+#include <spice-streaming-agent/tile-hash.hpp>
+#include <spice-streaming-agent/x11-image-capture.hpp>
+#include <spice-streaming-agent/frame-pacer.hpp>
+#include <spice-streaming-agent/error.hpp>
+#include <spice-streaming-agent/yuv-converter.hpp>
+
+#include "bounded-queue.hpp"
 
 
 #define gst_syslog(priority, str, ...) syslog(priority, "Gstreamer plugin: " str, ## __VA_ARGS__);
@@ -30,14 +47,81 @@ namespace spice {
 namespace streaming_agent {
 namespace gstreamer_plugin {
 
+// while the screen is static a frame is still encoded at this interval
+const int damage_keepalive_ms = 1000;
+// the synchronous pull checks the pipeline for errors at this interval
+const GstClockTime pull_timeout_ns = 100 * GST_MSECOND;
+// frames encoded by each candidate encoder when probing them
+const unsigned probe_frames = 10;
+// an encoder keeping a frame longer than that is not usable for streaming
+const GstClockTime probe_timeout_ns = GST_SECOND;
+// the conversion to YUV is bound by the memory bandwidth beyond that
+const unsigned max_yuv_threads = 4;
+
+enum class ChangeDetection
+{
+    Off,
+    XDamage,
+    TileHash,
+};
+
 struct GstreamerEncoderSettings
 {
     int fps = 25;
+    ChangeDetection change_detection = ChangeDetection::XDamage;
+    // capture and encode in the background instead of once per CaptureFrame
+    bool async = false;
     SpiceVideoCodecType codec = SPICE_VIDEO_CODEC_TYPE_H264;
     std::string encoder;
+    // apply the properties of latency_profiles, before the gst.prop ones
+    bool latency_profile = true;
+    // choose the fastest encoder by probing them, unless encoder is set
+    bool probe = false;
+    // build the first capture when the plugin is loaded
+    bool prewarm = false;
+    // seconds the pre-warmed capture waits for a stream before it is dropped
+    int prewarm_timeout = 60;
+    // convert the frames to the YUV format of the encoder in the agent
+    // instead of with autovideoconvert
+    bool yuv_convert = true;
     std::vector<std::pair<std::string, std::string>> prop_pairs;
 };
 
+struct ProfileProperty
+{
+    const char *factory;
+    const char *name;
+    // nullptr for the number of cores
+    const char *value;
+};
+
+/* Encoder properties for a live stream: the encoders default to offline
+ * quality settings (B-frames, lookahead, slow presets) which delay the
+ * frames by seconds. Properties missing in the encoder version installed
+ * are skipped.
+ */
+const ProfileProperty latency_profiles[] = {
+    { "x264enc", "tune", "zerolatency" },
+    { "x264enc", "speed-preset", "ultrafast" },
+    { "x264enc", "bframes", "0" },
+    { "x264enc", "sliced-threads", "true" },
+    { "x264enc", "threads", nullptr },
+    { "x265enc", "tune", "zerolatency" },
+    { "x265enc", "speed-preset", "ultrafast" },
+    { "vp8enc", "deadline", "1" },
+    { "vp8enc", "cpu-used", "16" },
+    { "vp8enc", "lag-in-frames", "0" },
+    { "vp8enc", "threads", nullptr },
+    { "vp9enc", "deadline", "1" },
+    { "vp9enc", "cpu-used", "8" },
+    { "vp9enc", "lag-in-frames", "0" },
+    { "vp9enc", "row-mt", "true" },
+    { "vp9enc", "threads", nullptr },
+    { "openh264enc", "usage-type", "screen" },
+    { "openh264enc", "complexity", "low" },
+    { "openh264enc", "multi-thread", nullptr },
+};
+
 template <typename T>
 struct GstObjectDeleter {
     void operator()(T* p)
@@ -67,29 +151,132 @@ struct GstSampleDeleter {
 
 using GstSampleUPtr = std::unique_ptr<GstSample, GstSampleDeleter>;
 
-class GstreamerFrameCapture final : public FrameCapture
+struct GstBufferPoolDeleter {
+    void operator()(GstBufferPool* p)
+    {
+        // the buffers still in the pipeline are freed once released
+        gst_buffer_pool_set_active(p, FALSE);
+        gst_object_unref(p);
+    }
+};
+
+using GstBufferPoolUPtr = std::unique_ptr<GstBufferPool, GstBufferPoolDeleter>;
+
+#if XLIB_CAPTURE
+/* Captured images handed to the pipeline without copy.
+ * Each image of the pool is captured through its own X11ImageCapture (a
+ * shared memory segment when MIT-SHM is usable) and goes back to the pool
+ * only when the pipeline releases the GstBuffer wrapping it, so several
+ * frames can be in flight in the encoder.
+ */
+class ImagePool : public std::enable_shared_from_this<ImagePool>
+{
+public:
+    ImagePool(Display *dpy) : dpy(dpy) {}
+
+    /* Captures an area of the window into a free image of the pool.
+     * When all the images are in use a temporary XGetImage is used.
+     * Returns a new buffer, *image is valid until the buffer is released.
+     */
+    GstBuffer *capture(Window win, unsigned width, unsigned height, XImage **image);
+
+private:
+    // beyond this number of frames in flight images are not pooled anymore
+    static const size_t max_images = 8;
+
+    struct Slot {
+        Slot(Display *dpy) : capture(dpy) {}
+        X11ImageCapture capture;
+        bool busy = false;
+    };
+    struct Release {
+        std::shared_ptr<ImagePool> pool;
+        Slot *slot;
+        XImage *image;
+    };
+    static void release_image(gpointer data);
+
+    Display *const dpy;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Slot>> slots;
+};
+#endif
+
+class GstreamerFrameCapture final : public FrameCapture, public PausableCapture
 {
 public:
     GstreamerFrameCapture(const GstreamerEncoderSettings &settings);
     ~GstreamerFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
+    void Pause() override;
     SpiceVideoCodecType VideoCodecType() const override {
         return settings.codec;
     }
     std::vector<DeviceDisplayInfo> get_device_display_info() const override;
 private:
+    // encoded samples waiting for CaptureFrame in asynchronous mode
+    static const size_t async_queue_size = 2;
+
     void free_sample();
+    void flush_pipeline();
+    void sync_pull_sample(FrameInfo &info);
+    void async_pull_sample(FrameInfo &info);
+    static GstFlowReturn on_new_sample(GstAppSink *appsink, gpointer user_data);
     GstElement *get_encoder_plugin(const GstreamerEncoderSettings &settings, GstCapsUPtr &sink_caps);
     GstElement *get_capture_plugin(const GstreamerEncoderSettings &settings);
     void pipeline_init(const GstreamerEncoderSettings &settings);
+    static void sample_size(GstSample *sample, int &width, int &height);
     Display *const dpy;
 #if XLIB_CAPTURE
     void xlib_capture();
-    XImage *image = nullptr;
+    GstBuffer *convert_image(GstBuffer *image_buffer, XImage *image);
+    void switch_resolution();
+    bool encoder_accepts(unsigned width, unsigned height);
+    void restart_pipeline();
+    bool restart_on_error();
+    void switch_done(int width, int height);
+    void capture_loop();
+    static void on_need_data(GstAppSrc *appsrc, guint length, gpointer user_data);
+    static void on_enough_data(GstAppSrc *appsrc, gpointer user_data);
+    std::shared_ptr<ImagePool> image_pool;
+    // converts the captured frames when the encoder takes I420 or NV12
+    std::unique_ptr<YuvConverter> yuv_converter;
+    // the buffers of the converted frames, for the format and size below
+    GstBufferPoolUPtr yuv_pool;
+    YuvFormat yuv_pool_format = YuvFormat::I420;
+    unsigned yuv_pool_width = 0, yuv_pool_height = 0;
+    std::unique_ptr<X11DamageTracker> damage_tracker;
+    std::unique_ptr<TileChangeDetector> tile_detector;
+    FramePacer pacer;
+    std::chrono::steady_clock::time_point last_push;
+    // capture the next frame without waiting for a change on screen
+    bool refresh = true;
+    /* Asynchronous mode: the capture thread feeds appsrc while it asks for
+     * data. The display is shared with get_device_display_info.
+     */
+    std::thread capture_thread;
+    mutable std::mutex display_mutex;
+    std::mutex feed_mutex;
+    std::condition_variable feed_cond;
+    bool feeding = true;
+    // no stream, between Pause and Reset
+    bool paused = false;
+    bool stopping = false;
+    std::exception_ptr capture_error;
+    /* Resolution switch in progress, until the first sample of the new
+     * size. The capture thread starts it, CaptureFrame completes it.
+     */
+    std::mutex switch_mutex;
+    bool switching = false;
+    bool switch_restarted = false;
+    unsigned switch_width = 0, switch_height = 0;
+    std::chrono::steady_clock::time_point switch_start;
 #endif
-    GstObjectUPtr<GstElement> pipeline, capture, sink;
+    GstObjectUPtr<GstElement> pipeline, capture, encoder, sink;
     GstSampleUPtr sample;
+    std::unique_ptr<BoundedQueue<GstSampleUPtr>> samples;
+    uint32_t sample_width = 0, sample_height = 0;
     GstMapInfo map = {};
     uint32_t last_width = ~0u, last_height = ~0u;
     uint32_t cur_width = 0, cur_height = 0;
@@ -100,16 +287,92 @@ private:
 class GstreamerPlugin final: public Plugin
 {
 public:
+    ~GstreamerPlugin();
     FrameCapture *CreateCapture() override;
     unsigned Rank() override;
     void ParseOptions(const ConfigureOption *options);
+    /* With gst.prewarm, builds a capture in the background and encodes a
+     * frame, which initializes the encoder for the screen size. The next
+     * CreateCapture hands it out, the stream starts without waiting for
+     * the pipeline construction. Unclaimed after gst.prewarm-timeout
+     * seconds, as when another plugin streams, the capture is destroyed.
+     */
+    void Prewarm();
     SpiceVideoCodecType VideoCodecType() const override {
         return settings.codec;
     }
 private:
+    enum class PrewarmState
+    {
+        Waiting,
+        Claimed,
+        Dropped,
+    };
+
     GstreamerEncoderSettings settings;
+    // null when the pre-warmed capture was dropped
+    std::future<std::unique_ptr<GstreamerFrameCapture>> prewarmed;
+    std::mutex prewarm_mutex;
+    std::condition_variable prewarm_cond;
+    PrewarmState prewarm_state = PrewarmState::Waiting;
 };
 
+#if XLIB_CAPTURE
+void ImagePool::release_image(gpointer data)
+{
+    std::unique_ptr<Release> release(static_cast<Release *>(data));
+    if (release->pool) {
+        std::lock_guard<std::mutex> lock(release->pool->mutex);
+        release->slot->busy = false;
+    } else {
+        XDestroyImage(release->image);
+    }
+}
+
+GstBuffer *ImagePool::capture(Window win, unsigned width, unsigned height, XImage **image)
+{
+    Slot *slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &candidate : slots) {
+            if (!candidate->busy) {
+                slot = candidate.get();
+                break;
+            }
+        }
+        if (!slot && slots.size() < max_images) {
+            slots.emplace_back(new Slot(dpy));
+            slot = slots.back().get();
+        }
+        if (slot) {
+            slot->busy = true;
+        }
+    }
+
+    Release *release;
+    if (slot) {
+        try {
+            *image = slot->capture.capture(win, 0, 0, width, height);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot->busy = false;
+            throw;
+        }
+        release = new Release{shared_from_this(), slot, nullptr};
+    } else {
+        *image = XGetImage(dpy, win, 0, 0, width, height, AllPlanes, ZPixmap);
+        if (!*image) {
+            throw std::runtime_error("Cannot capture from X");
+        }
+        release = new Release{nullptr, nullptr, *image};
+    }
+
+    const gsize size = (*image)->height * (*image)->bytes_per_line;
+    return gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (*image)->data, size, 0, size,
+                                       release, release_image);
+}
+#endif
+
 GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSettings &settings)
 {
     GstElement *capture = nullptr;
@@ -125,6 +388,308 @@ GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSett
     return capture;
 }
 
+// Utility to add an element to a GstBin
+// This checks return value and update reference correctly
+void gst_bin_add(GstBin *bin, const GstObjectUPtr<GstElement> &elem)
+{
+    if (::gst_bin_add(bin, elem.get())) {
+        // ::gst_bin_add take ownership using floating references but
+        // we still hold a reference in elem so update the reference
+        // accordingly
+        g_object_ref(elem.get());
+    } else {
+        throw std::runtime_error("Gstreamer's element cannot be added to pipeline");
+    }
+}
+
+/* Sets the low-latency profile then the gst.prop properties of the
+ * settings on an encoder created by factory. quiet skips the logs, when
+ * probing encoders.
+ */
+void set_encoder_properties(GstElement *encoder, GstElementFactory *factory,
+                            const GstreamerEncoderSettings &settings, bool quiet)
+{
+    if (settings.latency_profile) {
+        const std::string cores = std::to_string(std::max(1u, std::thread::hardware_concurrency()));
+        for (const auto &prop : latency_profiles) {
+            if (strcmp(prop.factory, GST_ELEMENT_NAME(factory)) != 0 ||
+                !g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), prop.name)) {
+                continue;
+            }
+            const char *value = prop.value ? prop.value : cores.c_str();
+            if (!quiet) {
+                gst_syslog(LOG_NOTICE, "Setting low-latency encoder property: '%s = %s'",
+                           prop.name, value);
+            }
+            gst_util_set_object_arg(G_OBJECT(encoder), prop.name, value);
+        }
+    }
+    // overriding the profile
+    for (const auto &prop : settings.prop_pairs) {
+        const auto &name = prop.first;
+        const auto &value = prop.second;
+        if (!g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), name.c_str())) {
+            if (!quiet) {
+                gst_syslog(LOG_WARNING, "'%s' property was not found for this encoder",
+                           name.c_str());
+            }
+            continue;
+        }
+        if (!quiet) {
+            gst_syslog(LOG_NOTICE, "Trying to set encoder property: '%s = %s'",
+                       name.c_str(), value.c_str());
+        }
+        /* Invalid properties will be ignored silently */
+        gst_util_set_object_arg(G_OBJECT(encoder), name.c_str(), value.c_str());
+    }
+}
+
+struct ProbeResult
+{
+    std::string encoder;
+    // average time from pushing a frame to getting it encoded
+    uint64_t latency_us;
+    // average size of an encoded frame
+    size_t frame_bytes;
+};
+
+/* Encodes probe_frames synthetic frames of width x height pixels through
+ * the encoder, one at a time. Returns false if the encoder failed, or kept
+ * a frame longer than probe_timeout_ns, which rules it out for streaming.
+ * The first frame, which includes the encoder initialization, is not
+ * counted.
+ */
+bool probe_encoder(GstElementFactory *factory, const GstreamerEncoderSettings &settings,
+                   GstCaps *sink_caps, unsigned width, unsigned height, ProbeResult &result)
+{
+    GstObjectUPtr<GstElement> pipeline(gst_pipeline_new("probe"));
+    GstObjectUPtr<GstElement> src(gst_element_factory_make("appsrc", nullptr));
+    GstObjectUPtr<GstElement> convert(gst_element_factory_make("videoconvert", nullptr));
+    GstObjectUPtr<GstElement> encoder(gst_element_factory_create(factory, nullptr));
+    GstObjectUPtr<GstElement> sink(gst_element_factory_make("appsink", nullptr));
+    if (!pipeline || !src || !convert || !encoder || !sink) {
+        return false;
+    }
+    set_encoder_properties(encoder.get(), factory, settings, true);
+
+    GstCapsUPtr caps(gst_caps_new_simple("video/x-raw",
+                                         "format", G_TYPE_STRING, "BGRx",
+                                         "width", G_TYPE_INT, width,
+                                         "height", G_TYPE_INT, height,
+                                         "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                         nullptr));
+    g_object_set(src.get(),
+                 "caps", caps.get(),
+                 "format", GST_FORMAT_TIME,
+                 nullptr);
+    g_object_set(sink.get(), "sync", FALSE, nullptr);
+
+    GstBin *bin = GST_BIN(pipeline.get());
+    gst_bin_add(bin, src);
+    gst_bin_add(bin, convert);
+    gst_bin_add(bin, encoder);
+    gst_bin_add(bin, sink);
+    if (!gst_element_link_many(src.get(), convert.get(), encoder.get(), nullptr) ||
+        !gst_element_link_filtered(encoder.get(), sink.get(), sink_caps) ||
+        gst_element_set_state(pipeline.get(), GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+        return false;
+    }
+
+    const size_t size = width * height * 4;
+    std::vector<uint8_t> pixels(size);
+    uint64_t total_us = 0;
+    size_t total_bytes = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < probe_frames && ok; ++i) {
+        // a gradient scrolling by a few pixels, with some detail for the
+        // entropy coder
+        for (unsigned y = 0; y < height; ++y) {
+            uint8_t *line = &pixels[y * width * 4];
+            for (unsigned x = 0; x < width; ++x) {
+                line[x * 4] = x + i * 4;
+                line[x * 4 + 1] = y;
+                line[x * 4 + 2] = (x ^ y) & 0x3f;
+            }
+        }
+        GstBuffer *buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+        gst_buffer_fill(buffer, 0, pixels.data(), size);
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND, settings.fps);
+        GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(1, GST_SECOND, settings.fps);
+
+        const auto start = std::chrono::steady_clock::now();
+        // takes the buffer
+        if (gst_app_src_push_buffer(GST_APP_SRC(src.get()), buffer) != GST_FLOW_OK) {
+            ok = false;
+            break;
+        }
+        GstSampleUPtr sample(gst_app_sink_try_pull_sample(GST_APP_SINK(sink.get()),
+                                                          probe_timeout_ns));
+        if (!sample) {
+            ok = false;
+            break;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        if (i > 0) {
+            total_us += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            total_bytes += gst_buffer_get_size(gst_sample_get_buffer(sample.get()));
+        }
+    }
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+
+    if (ok) {
+        result.encoder = GST_ELEMENT_NAME(factory);
+        result.latency_us = total_us / (probe_frames - 1);
+        result.frame_bytes = total_bytes / (probe_frames - 1);
+    }
+    return ok;
+}
+
+std::string cpu_model()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            const size_t colon = line.find(':');
+            return colon != std::string::npos ? line.substr(colon + 2) : line;
+        }
+    }
+    return "unknown";
+}
+
+/* The ranking of the encoders holds while the GStreamer version, the
+ * candidate encoders (and their plugins versions), the CPU, the stream caps
+ * and the resolution stay the same.
+ */
+std::string probe_key(GList *candidates, const char *caps, unsigned width, unsigned height)
+{
+    std::string key = std::string("gstreamer ") + gst_version_string();
+    for (GList *l = candidates; l != nullptr; l = l->next) {
+        GstPlugin *plugin = gst_plugin_feature_get_plugin(GST_PLUGIN_FEATURE(l->data));
+        key += std::string(" ") + GST_ELEMENT_NAME(l->data) + "/" +
+            (plugin ? gst_plugin_get_version(plugin) : "?");
+        if (plugin) {
+            gst_object_unref(plugin);
+        }
+    }
+    key += "|" + cpu_model() + "|" + caps + "|" +
+        std::to_string(width) + "x" + std::to_string(height);
+    // one line of the cache
+    std::replace(key.begin(), key.end(), '\t', ' ');
+    std::replace(key.begin(), key.end(), '\n', ' ');
+    return key;
+}
+
+std::string probe_cache_path()
+{
+    return std::string(g_get_user_cache_dir()) + "/spice-streaming-agent/gst-encoders";
+}
+
+/* The cache holds one line per key: the key, a tab and the encoder names
+ * from the fastest, separated by commas.
+ */
+bool read_ranking(const std::string &key, std::vector<std::string> &ranking)
+{
+    std::ifstream cache(probe_cache_path());
+    std::string line;
+    while (std::getline(cache, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos || line.compare(0, tab, key) != 0 || tab != key.size()) {
+            continue;
+        }
+        std::istringstream names(line.substr(tab + 1));
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            ranking.push_back(name);
+        }
+        // an empty ranking, left by an older version, is probed again
+        return !ranking.empty();
+    }
+    return false;
+}
+
+void write_ranking(const std::string &key, const std::vector<std::string> &ranking)
+{
+    const std::string path = probe_cache_path();
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(path);
+        std::string line;
+        while (std::getline(cache, line)) {
+            if (line.compare(0, key.size() + 1, key + "\t") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+    std::string entry = key + "\t";
+    for (size_t i = 0; i < ranking.size(); ++i) {
+        entry += (i ? "," : "") + ranking[i];
+    }
+    lines.push_back(entry);
+
+    const std::string dir = path.substr(0, path.rfind('/'));
+    g_mkdir_with_parents(dir.c_str(), 0700);
+    std::ofstream cache(path, std::ios::trunc);
+    for (const auto &line : lines) {
+        cache << line << '\n';
+    }
+    if (!cache) {
+        gst_syslog(LOG_WARNING, "Cannot write the encoder ranking to %s", path.c_str());
+    }
+}
+
+/* Returns the fastest of the candidate encoders, from the cache or by
+ * probing them, nullptr if none of them works.
+ */
+GstElementFactory *fastest_encoder(GList *candidates, const GstreamerEncoderSettings &settings,
+                                   GstCaps *sink_caps, const char *caps_str,
+                                   unsigned width, unsigned height)
+{
+    const std::string key = probe_key(candidates, caps_str, width, height);
+    std::vector<std::string> ranking;
+    if (read_ranking(key, ranking)) {
+        gst_syslog(LOG_NOTICE, "Using the cached ranking of the encoders for %ux%u",
+                   width, height);
+    } else {
+        std::vector<ProbeResult> results;
+        for (GList *l = candidates; l != nullptr; l = l->next) {
+            ProbeResult result;
+            if (!probe_encoder((GstElementFactory *) l->data, settings, sink_caps,
+                               width, height, result)) {
+                gst_syslog(LOG_NOTICE, "Probing '%s': failed or too slow",
+                           GST_ELEMENT_NAME(l->data));
+                continue;
+            }
+            gst_syslog(LOG_NOTICE, "Probing '%s': %" PRIu64 " us and %zu bytes per %ux%u frame",
+                       result.encoder.c_str(), result.latency_us, result.frame_bytes,
+                       width, height);
+            results.push_back(result);
+        }
+        std::stable_sort(results.begin(), results.end(),
+                         [](const ProbeResult &a, const ProbeResult &b) {
+                             return a.latency_us < b.latency_us;
+                         });
+        for (const auto &result : results) {
+            ranking.push_back(result.encoder);
+        }
+        // when every probe failed, as they may on a loaded machine, the
+        // next start probes again
+        if (!ranking.empty()) {
+            write_ranking(key, ranking);
+        }
+    }
+
+    for (const auto &name : ranking) {
+        for (GList *l = candidates; l != nullptr; l = l->next) {
+            if (name == GST_ELEMENT_NAME(l->data)) {
+                return (GstElementFactory *) l->data;
+            }
+        }
+    }
+    return nullptr;
+}
+
 GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSettings &settings,
                                                       GstCapsUPtr &sink_caps)
 {
@@ -172,6 +737,14 @@ GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSett
                        "Specified encoder named '%s' cannot produce '%s' stream, make sure matching gst.codec is specified and plugin's availability",
                        settings.encoder.c_str(), caps_str.get());
         }
+        if (!factory && settings.probe) {
+            XWindowAttributes root;
+            XGetWindowAttributes(dpy, RootWindow(dpy, XDefaultScreen(dpy)), &root);
+            // as captured, see xlib_capture
+            factory = fastest_encoder(filtered, settings, sink_caps.get(), caps_str.get(),
+                                      root.width - root.width % 2,
+                                      root.height - root.height % 2);
+        }
         factory = factory ? factory : (GstElementFactory*)filtered->data;
         gst_syslog(LOG_NOTICE, "'%s' encoder plugin is used", GST_ELEMENT_NAME(factory));
 
@@ -181,38 +754,66 @@ GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSett
 
     encoder = factory ? gst_element_factory_create(factory, "encoder") : nullptr;
     if (encoder) { // Set encoder properties
-        for (const auto &prop : settings.prop_pairs) {
-            const auto &name = prop.first;
-            const auto &value = prop.second;
-            if (!g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), name.c_str())) {
-                gst_syslog(LOG_WARNING, "'%s' property was not found for this encoder",
-                           name.c_str());
-                continue;
-            }
-            gst_syslog(LOG_NOTICE, "Trying to set encoder property: '%s = %s'",
-                       name.c_str(), value.c_str());
-            /* Invalid properties will be ignored silently */
-            gst_util_set_object_arg(G_OBJECT(encoder), name.c_str(), value.c_str());
-        }
+        set_encoder_properties(encoder, factory, settings, false);
     }
     gst_plugin_feature_list_free(filtered);
     gst_plugin_feature_list_free(encoders);
     return encoder;
 }
 
-// Utility to add an element to a GstBin
-// This checks return value and update reference correctly
-void gst_bin_add(GstBin *bin, const GstObjectUPtr<GstElement> &elem)
+#if XLIB_CAPTURE
+const char *yuv_format_name(YuvFormat format)
 {
-    if (::gst_bin_add(bin, elem.get())) {
-        // ::gst_bin_add take ownership using floating references but
-        // we still hold a reference in elem so update the reference
-        // accordingly
-        g_object_ref(elem.get());
-    } else {
-        throw std::runtime_error("Gstreamer's element cannot be added to pipeline");
+    return format == YuvFormat::NV12 ? "NV12" : "I420";
+}
+
+/* Finds the first of I420 and NV12 in the raw formats the encoder takes,
+ * which encoders list by order of preference. Formats in other memories
+ * than the system one (GL, VA surfaces...) cannot be filled by the agent.
+ */
+bool encoder_yuv_format(GstElement *encoder, YuvFormat &format)
+{
+    GstObjectUPtr<GstPad> pad(gst_element_get_static_pad(encoder, "sink"));
+    if (!pad) {
+        return false;
     }
+    GstCapsUPtr caps(gst_pad_query_caps(pad.get(), nullptr));
+    if (!caps) {
+        return false;
+    }
+    for (guint i = 0; i < gst_caps_get_size(caps.get()); ++i) {
+        GstCapsFeatures *features = gst_caps_get_features(caps.get(), i);
+        if (features && !gst_caps_features_contains(features, GST_CAPS_FEATURE_MEMORY_SYSTEM_MEMORY)) {
+            continue;
+        }
+        const GValue *formats = gst_structure_get_value(gst_caps_get_structure(caps.get(), i),
+                                                        "format");
+        std::vector<const GValue *> values;
+        if (formats && GST_VALUE_HOLDS_LIST(formats)) {
+            for (guint j = 0; j < gst_value_list_get_size(formats); ++j) {
+                values.push_back(gst_value_list_get_value(formats, j));
+            }
+        } else if (formats) {
+            values.push_back(formats);
+        }
+        for (const GValue *value : values) {
+            if (!G_VALUE_HOLDS_STRING(value)) {
+                continue;
+            }
+            const char *name = g_value_get_string(value);
+            if (strcmp(name, "I420") == 0) {
+                format = YuvFormat::I420;
+                return true;
+            }
+            if (strcmp(name, "NV12") == 0) {
+                format = YuvFormat::NV12;
+                return true;
+            }
+        }
+    }
+    return false;
 }
+#endif
 
 void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settings)
 {
@@ -226,15 +827,29 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
     if (!capture) {
         throw std::runtime_error("Gstreamer's capture element cannot be created");
     }
-    GstObjectUPtr<GstElement> convert(gst_element_factory_make("autovideoconvert", "convert"));
-    if (!convert) {
-        throw std::runtime_error("Gstreamer's 'autovideoconvert' element cannot be created");
-    }
     GstCapsUPtr sink_caps;
     GstObjectUPtr<GstElement> encoder(get_encoder_plugin(settings, sink_caps));
     if (!encoder) {
         throw std::runtime_error("Gstreamer's encoder element cannot be created");
     }
+    std::unique_ptr<YuvConverter> yuv_converter;
+#if XLIB_CAPTURE
+    YuvFormat yuv_format;
+    if (settings.yuv_convert && encoder_yuv_format(encoder.get(), yuv_format)) {
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        yuv_converter.reset(new YuvConverter(yuv_format, std::min(cores, max_yuv_threads)));
+        gst_syslog(LOG_NOTICE, "Converting the frames to %s with %u threads",
+                   yuv_format_name(yuv_format), yuv_converter->threads());
+    }
+#endif
+    // appsrc feeds the encoder directly with the converted frames
+    GstObjectUPtr<GstElement> convert;
+    if (!yuv_converter) {
+        convert.reset(gst_element_factory_make("autovideoconvert", "convert"));
+        if (!convert) {
+            throw std::runtime_error("Gstreamer's 'autovideoconvert' element cannot be created");
+        }
+    }
     GstObjectUPtr<GstElement> sink(gst_element_factory_make("appsink", "sink"));
     if (!sink) {
         throw std::runtime_error("Gstreamer's appsink element cannot be created");
@@ -245,17 +860,39 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
                  "drop", TRUE,
                  "max-buffers", 1,
                  nullptr);
+    if (settings.async) {
+        GstAppSinkCallbacks sink_callbacks = {};
+        sink_callbacks.new_sample = on_new_sample;
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink.get()), &sink_callbacks, this, nullptr);
+#if XLIB_CAPTURE
+        g_object_set(capture.get(),
+                     "is-live", TRUE,
+                     "format", GST_FORMAT_TIME,
+                     "do-timestamp", TRUE,
+                     nullptr);
+        GstAppSrcCallbacks src_callbacks = {};
+        src_callbacks.need_data = on_need_data;
+        src_callbacks.enough_data = on_enough_data;
+        gst_app_src_set_callbacks(GST_APP_SRC(capture.get()), &src_callbacks, this, nullptr);
+#endif
+    }
 
     GstBin *bin = GST_BIN(pipeline.get());
     gst_bin_add(bin, capture);
-    gst_bin_add(bin, convert);
+    if (convert) {
+        gst_bin_add(bin, convert);
+    }
     gst_bin_add(bin, encoder);
     gst_bin_add(bin, sink);
 
-    GstCapsUPtr caps(gst_caps_from_string("video/x-raw"));
-    link = gst_element_link(capture.get(), convert.get()) &&
-           gst_element_link_filtered(convert.get(), encoder.get(), caps.get()) &&
-           gst_element_link_filtered(encoder.get(), sink.get(), sink_caps.get());
+    if (convert) {
+        GstCapsUPtr caps(gst_caps_from_string("video/x-raw"));
+        link = gst_element_link(capture.get(), convert.get()) &&
+               gst_element_link_filtered(convert.get(), encoder.get(), caps.get());
+    } else {
+        link = gst_element_link(capture.get(), encoder.get());
+    }
+    link = link && gst_element_link_filtered(encoder.get(), sink.get(), sink_caps.get());
     if (!link) {
         throw std::runtime_error("Linking gstreamer's elements failed");
     }
@@ -287,17 +924,50 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
 #endif
 
     this->sink.swap(sink);
+    this->encoder.swap(encoder);
     this->capture.swap(capture);
     this->pipeline.swap(pipeline);
+#if XLIB_CAPTURE
+    this->yuv_converter.swap(yuv_converter);
+#endif
 }
 
 GstreamerFrameCapture::GstreamerFrameCapture(const GstreamerEncoderSettings &settings):
-    dpy(XOpenDisplay(nullptr)),settings(settings)
+    dpy(XOpenDisplay(nullptr)),
+#if XLIB_CAPTURE
+    pacer(settings.fps),
+#endif
+    settings(settings)
 {
     if (!dpy) {
         throw std::runtime_error("Unable to initialize X11");
     }
+    if (settings.async) {
+        // inter-coded streams cannot lose frames, the encoder waits instead
+        samples.reset(new BoundedQueue<GstSampleUPtr>(
+            async_queue_size,
+            settings.codec == SPICE_VIDEO_CODEC_TYPE_MJPEG ?
+            OverflowPolicy::DropOldest : OverflowPolicy::Block));
+    }
     pipeline_init(settings);
+
+#if XLIB_CAPTURE
+    image_pool = std::make_shared<ImagePool>(dpy);
+
+    if (settings.change_detection == ChangeDetection::XDamage) {
+        try {
+            damage_tracker.reset(new X11DamageTracker(dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+        } catch (const Error &e) {
+            gst_syslog(LOG_WARNING, "%s, capturing every frame", e.what());
+        }
+    } else if (settings.change_detection == ChangeDetection::TileHash) {
+        tile_detector.reset(new TileChangeDetector());
+    }
+
+    if (settings.async) {
+        capture_thread = std::thread(&GstreamerFrameCapture::capture_loop, this);
+    }
+#endif
 }
 
 void GstreamerFrameCapture::free_sample()
@@ -306,29 +976,134 @@ void GstreamerFrameCapture::free_sample()
         gst_buffer_unmap(gst_sample_get_buffer(sample.get()), &map);
         sample.reset();
     }
-#if XLIB_CAPTURE
-    if(image) {
-        image->f.destroy_image(image);
-        image = nullptr;
-    }
-#endif
 }
 
 GstreamerFrameCapture::~GstreamerFrameCapture()
 {
     free_sample();
+    if (samples) {
+        // unblocks the appsink callback
+        samples->close();
+    }
+#if XLIB_CAPTURE
+    if (capture_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(feed_mutex);
+            stopping = true;
+        }
+        feed_cond.notify_all();
+        capture_thread.join();
+    }
+
+    const FramePacerStats &stats = pacer.stats();
+    gst_syslog(LOG_DEBUG, "frame pacing: %" PRIu64 " frames, %" PRIu64 " missed deadlines, "
+               "%" PRIu64 " skipped frames, jitter avg %" PRIu64 " us max %" PRIu64 " us",
+               stats.frames, stats.missed, stats.skipped,
+               stats.frames ? stats.total_jitter_ns / stats.frames / 1000 : 0,
+               stats.max_jitter_ns / 1000);
+#endif
     gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+#if XLIB_CAPTURE
+    // the pipeline released all the images, free them before the display
+    image_pool.reset();
+    yuv_pool.reset();
+    damage_tracker.reset();
+#endif
     XCloseDisplay(dpy);
 }
 
+/* Drops the frames in flight in the pipeline and asks the encoder for a
+ * key frame, the pipeline keeps playing.
+ * The appsink callback may be blocked on a full queue, which must be
+ * emptied between the flush start (no new sample reaches the callback
+ * anymore) and the flush stop (which waits for the streaming threads).
+ */
+void GstreamerFrameCapture::flush_pipeline()
+{
+    free_sample();
+    gst_element_send_event(capture.get(), gst_event_new_flush_start());
+    if (samples) {
+        samples->clear();
+    }
+    // appsrc drops its queued buffers too
+    gst_element_send_event(capture.get(), gst_event_new_flush_stop(TRUE));
+    if (samples) {
+        samples->clear();
+    }
+
+    // the upstream event of gst_video_event_new_upstream_force_key_unit,
+    // without depending on gstreamer-video
+    GstObjectUPtr<GstPad> pad(gst_element_get_static_pad(encoder.get(), "src"));
+    GstStructure *structure = gst_structure_new("GstForceKeyUnit",
+                                                "all-headers", G_TYPE_BOOLEAN, TRUE,
+                                                nullptr);
+    if (!pad || !gst_pad_send_event(pad.get(), gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                                      structure))) {
+        gst_syslog(LOG_WARNING, "The encoder did not accept to start with a key frame");
+    }
+}
+
+/* Restarts the stream on the same pipeline, much faster than building a
+ * new capture: the next frame is captured at once and starts a new stream.
+ */
 void GstreamerFrameCapture::Reset()
 {
-    //TODO
+    const auto start = std::chrono::steady_clock::now();
+#if XLIB_CAPTURE
+    // the capture thread is not feeding the pipeline while it is flushed
+    std::lock_guard<std::mutex> lock(display_mutex);
+#endif
+    flush_pipeline();
+
+    is_first = true;
+    sample_width = sample_height = 0;
+#if XLIB_CAPTURE
+    refresh = true;
+    if (tile_detector) {
+        tile_detector->reset();
+    }
+    pacer.reset();
+    {
+        std::lock_guard<std::mutex> lock(switch_mutex);
+        switching = false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(feed_mutex);
+        paused = false;
+    }
+    feed_cond.notify_one();
+#endif
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    gst_syslog(LOG_DEBUG, "Pipeline flushed in %" PRId64 " us",
+               (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+/* Stops the capture thread, which otherwise captures and encodes as long
+ * as appsrc asks for data, while no stream consumes the frames. The
+ * frames already in the pipeline are dropped by the next Reset.
+ */
+void GstreamerFrameCapture::Pause()
+{
+#if XLIB_CAPTURE
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    paused = true;
+#endif
 }
 
 #if XLIB_CAPTURE
 void GstreamerFrameCapture::xlib_capture()
 {
+    pacer.wait();
+
+    if (damage_tracker && !refresh) {
+        // do not capture nor encode anything until the screen changes, the
+        // timeout keeps the stream (and the command loop) alive
+        damage_tracker->wait_for_damage(damage_keepalive_ms);
+        pacer.resync();
+    }
+    refresh = false;
+
     int screen = XDefaultScreen(dpy);
 
     Window win = RootWindow(dpy, screen);
@@ -339,49 +1114,279 @@ void GstreamerFrameCapture::xlib_capture()
     cur_width = win_info.width - win_info.width % 2;
     cur_height =  win_info.height - win_info.height % 2;
 
+    restart_on_error();
     if (cur_width != last_width || cur_height != last_height) {
+        // the first frame sets the caps of a new pipeline, nothing to switch
+        if (last_width != ~0u) {
+            switch_resolution();
+        }
         last_width = cur_width;
         last_height = cur_height;
         is_first = true;
-
-        gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
-        gst_element_set_state(pipeline.get(), GST_STATE_NULL);//maybe ximagesrc needs eos as well
-        gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
     }
 
-    image = XGetImage(dpy, win, 0, 0,
-                      cur_width, cur_height, AllPlanes, ZPixmap);
-    if (!image) {
-        throw std::runtime_error("Cannot capture from X");
+    if (damage_tracker) {
+        // changes happening from now on are reported for the next frame
+        damage_tracker->take_damage();
     }
 
+    XImage *image;
     GstBuffer *buf;
-    buf = gst_buffer_new_wrapped(image->data, image->height * image->bytes_per_line);
-    if (!buf) {
-        throw std::runtime_error("Failed to wrap image in gstreamer buffer");
+    for (;;) {
+        buf = image_pool->capture(win, cur_width, cur_height, &image);
+        if (!tile_detector) {
+            break;
+        }
+
+        // only feed the encoder when some tile changed, or at the
+        // keepalive interval
+        const auto now = std::chrono::steady_clock::now();
+        if (tile_detector->update((uint8_t *) image->data, image->width, image->height,
+                                  image->bytes_per_line) > 0 ||
+            now - last_push >= std::chrono::milliseconds(damage_keepalive_ms)) {
+            last_push = now;
+            break;
+        }
+        gst_buffer_unref(buf);
+        pacer.wait();
+    }
+
+    const char *format = "BGRx";
+    if (yuv_converter) {
+        buf = convert_image(buf, image);
+        format = yuv_format_name(yuv_converter->format());
     }
 
     GstCapsUPtr caps(gst_caps_new_simple("video/x-raw",
-                                         "format", G_TYPE_STRING, "BGRx",
+                                         "format", G_TYPE_STRING, format,
                                          "width", G_TYPE_INT, image->width,
                                          "height", G_TYPE_INT, image->height,
                                          "framerate", GST_TYPE_FRACTION, settings.fps, 1,
                                          nullptr));
+    if (yuv_converter) {
+        // the matrix and the chroma position of YuvConverter
+        gst_caps_set_simple(caps.get(),
+                            "colorimetry", G_TYPE_STRING, "bt601",
+                            "chroma-site", G_TYPE_STRING, "jpeg",
+                            nullptr);
+    }
 
     // Push sample
     GstSampleUPtr appsrc_sample(gst_sample_new(buf, caps.get(), nullptr, nullptr));
+    // the sample holds its own reference, the image returns to the pool
+    // once the pipeline is done with it
+    gst_buffer_unref(buf);
     if (gst_app_src_push_sample(GST_APP_SRC(capture.get()), appsrc_sample.get()) != GST_FLOW_OK) {
         throw std::runtime_error("gstramer appsrc element cannot push sample");
     }
 }
+
+/* Converts the captured image to a buffer of yuv_pool, laid out as
+ * GStreamer expects the raw YUV formats. The image returns to the image
+ * pool at once, the pipeline holds the converted frame only, which goes
+ * back to yuv_pool once the encoder releases it. The pool is replaced
+ * when the size of the frames changes.
+ */
+GstBuffer *GstreamerFrameCapture::convert_image(GstBuffer *image_buffer, XImage *image)
+{
+    const YuvFormat format = yuv_converter->format();
+    const YuvLayout layout = YuvLayout::compute(format, image->width, image->height);
+    if (!yuv_pool || yuv_pool_format != format ||
+        yuv_pool_width != (unsigned) image->width || yuv_pool_height != (unsigned) image->height) {
+        yuv_pool.reset();
+        GstBufferPoolUPtr pool(gst_buffer_pool_new());
+        GstCapsUPtr caps(gst_caps_new_simple("video/x-raw",
+                                             "format", G_TYPE_STRING, yuv_format_name(format),
+                                             "width", G_TYPE_INT, image->width,
+                                             "height", G_TYPE_INT, image->height,
+                                             nullptr));
+        GstStructure *config = gst_buffer_pool_get_config(pool.get());
+        // no maximum, the pool grows to the frames the encoder holds
+        gst_buffer_pool_config_set_params(config, caps.get(), layout.size, 0, 0);
+        if (!gst_buffer_pool_set_config(pool.get(), config) ||
+            !gst_buffer_pool_set_active(pool.get(), TRUE)) {
+            gst_buffer_unref(image_buffer);
+            throw std::runtime_error("Cannot set up the pool of the converted frames");
+        }
+        yuv_pool = std::move(pool);
+        yuv_pool_format = format;
+        yuv_pool_width = image->width;
+        yuv_pool_height = image->height;
+    }
+
+    GstBuffer *buffer = nullptr;
+    GstMapInfo yuv_map;
+    if (gst_buffer_pool_acquire_buffer(yuv_pool.get(), &buffer, nullptr) != GST_FLOW_OK ||
+        !gst_buffer_map(buffer, &yuv_map, GST_MAP_WRITE)) {
+        if (buffer) {
+            gst_buffer_unref(buffer);
+        }
+        gst_buffer_unref(image_buffer);
+        throw std::runtime_error("Cannot allocate a buffer for the converted frame");
+    }
+    yuv_converter->convert((const uint8_t *) image->data, image->bytes_per_line,
+                           image->width, image->height, yuv_map.data);
+    gst_buffer_unmap(buffer, &yuv_map);
+    gst_buffer_unref(image_buffer);
+    return buffer;
+}
+
+/* The samples pushed with the new size carry new caps, which renegotiate
+ * the converter and the encoder while the pipeline keeps playing. Only an
+ * encoder that does not support the new size is restarted, which
+ * re-initializes it, see restart_on_error for the encoders that fail to
+ * renegotiate later on.
+ */
+void GstreamerFrameCapture::switch_resolution()
+{
+    {
+        std::lock_guard<std::mutex> lock(switch_mutex);
+        switching = true;
+        switch_restarted = false;
+        switch_width = cur_width;
+        switch_height = cur_height;
+        switch_start = std::chrono::steady_clock::now();
+    }
+
+    if (!encoder_accepts(cur_width, cur_height)) {
+        gst_syslog(LOG_NOTICE, "The encoder does not accept %ux%u frames as they are, restarting the pipeline",
+                   cur_width, cur_height);
+        restart_pipeline();
+    }
+}
+
+bool GstreamerFrameCapture::encoder_accepts(unsigned width, unsigned height)
+{
+    GstObjectUPtr<GstPad> pad(gst_element_get_static_pad(encoder.get(), "sink"));
+    if (!pad) {
+        return false;
+    }
+    GstCapsUPtr filter(gst_caps_new_simple("video/x-raw",
+                                           "width", G_TYPE_INT, width,
+                                           "height", G_TYPE_INT, height,
+                                           nullptr));
+    GstCapsUPtr caps(gst_pad_query_caps(pad.get(), filter.get()));
+    return caps && !gst_caps_is_empty(caps.get());
+}
+
+void GstreamerFrameCapture::restart_pipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(switch_mutex);
+        switch_restarted = true;
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
+    // the bus is flushed too
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+    gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+}
+
+/* Returns true when the pipeline was restarted because the encoder failed
+ * to renegotiate to the new resolution, any other error is thrown.
+ */
+bool GstreamerFrameCapture::restart_on_error()
+{
+    GstObjectUPtr<GstBus> bus(gst_element_get_bus(pipeline.get()));
+    GstMessage *message = gst_bus_pop_filtered(bus.get(), GST_MESSAGE_ERROR);
+    if (!message) {
+        return false;
+    }
+
+    GError *error = nullptr;
+    gst_message_parse_error(message, &error, nullptr);
+    const std::string text = error ? error->message : "unknown error";
+    g_clear_error(&error);
+    gst_message_unref(message);
+
+    bool renegotiating;
+    {
+        std::lock_guard<std::mutex> lock(switch_mutex);
+        renegotiating = switching && !switch_restarted;
+    }
+    if (!renegotiating) {
+        throw std::runtime_error("Gstreamer pipeline error: " + text);
+    }
+    gst_syslog(LOG_NOTICE, "The encoder failed to renegotiate to %ux%u (%s), restarting the pipeline",
+               cur_width, cur_height, text.c_str());
+    restart_pipeline();
+    return true;
+}
+
+void GstreamerFrameCapture::switch_done(int width, int height)
+{
+    std::lock_guard<std::mutex> lock(switch_mutex);
+    if (!switching || width != (int) switch_width || height != (int) switch_height) {
+        return;
+    }
+    switching = false;
+    const auto elapsed = std::chrono::steady_clock::now() - switch_start;
+    gst_syslog(LOG_NOTICE, "Switched to %dx%d in %" PRId64 " ms (%s)", width, height,
+               (int64_t) std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(),
+               switch_restarted ? "pipeline restarted" : "caps renegotiated");
+}
+
+void GstreamerFrameCapture::capture_loop()
+{
+    try {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(feed_mutex);
+                feed_cond.wait(lock, [this] { return (feeding && !paused) || stopping; });
+                if (stopping) {
+                    break;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(display_mutex);
+            xlib_capture();
+        }
+    } catch (...) {
+        // reported by CaptureFrame once the queued samples are consumed
+        capture_error = std::current_exception();
+        samples->close();
+    }
+}
+
+void GstreamerFrameCapture::on_need_data(GstAppSrc *, guint, gpointer user_data)
+{
+    auto self = static_cast<GstreamerFrameCapture *>(user_data);
+    {
+        std::lock_guard<std::mutex> lock(self->feed_mutex);
+        self->feeding = true;
+    }
+    self->feed_cond.notify_one();
+}
+
+void GstreamerFrameCapture::on_enough_data(GstAppSrc *, gpointer user_data)
+{
+    auto self = static_cast<GstreamerFrameCapture *>(user_data);
+    std::lock_guard<std::mutex> lock(self->feed_mutex);
+    self->feeding = false;
+}
 #endif
 
-FrameInfo GstreamerFrameCapture::CaptureFrame()
+GstFlowReturn GstreamerFrameCapture::on_new_sample(GstAppSink *appsink, gpointer user_data)
 {
-    FrameInfo info;
+    auto self = static_cast<GstreamerFrameCapture *>(user_data);
+    GstSampleUPtr encoded(gst_app_sink_pull_sample(appsink));
+    if (!encoded) {
+        return GST_FLOW_ERROR;
+    }
+    return self->samples->push(std::move(encoded)) ? GST_FLOW_OK : GST_FLOW_FLUSHING;
+}
 
-    free_sample(); // free prev if exist
+void GstreamerFrameCapture::sample_size(GstSample *sample, int &width, int &height)
+{
+    GstCaps *caps = gst_sample_get_caps(sample);
+    if (caps && gst_caps_get_size(caps) > 0) {
+        const GstStructure *structure = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(structure, "width", &width);
+        gst_structure_get_int(structure, "height", &height);
+    }
+}
 
+void GstreamerFrameCapture::sync_pull_sample(FrameInfo &info)
+{
 #if XLIB_CAPTURE
     xlib_capture();
 #endif
@@ -392,8 +1397,69 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
         is_first = false;
     }
 
-    // Pull sample
-    sample.reset(gst_app_sink_pull_sample(GST_APP_SINK(sink.get()))); // blocking
+    // Pull sample, blocking until the encoder outputs it
+    for (;;) {
+        sample.reset(gst_app_sink_try_pull_sample(GST_APP_SINK(sink.get()), pull_timeout_ns));
+        if (sample || gst_app_sink_is_eos(GST_APP_SINK(sink.get()))) {
+            break;
+        }
+#if XLIB_CAPTURE
+        // the frame was lost with the failed renegotiation, feed another
+        if (restart_on_error()) {
+            xlib_capture();
+        }
+#endif
+    }
+#if XLIB_CAPTURE
+    if (sample) {
+        int width = cur_width, height = cur_height;
+        sample_size(sample.get(), width, height);
+        switch_done(width, height);
+    }
+#endif
+}
+
+void GstreamerFrameCapture::async_pull_sample(FrameInfo &info)
+{
+    if (!samples->pop(sample)) {
+#if XLIB_CAPTURE
+        if (capture_error) {
+            std::rethrow_exception(capture_error);
+        }
+#endif
+        return;
+    }
+
+    // the capture thread may have changed the resolution since this frame
+    // was captured, the encoder output caps tell the size of this one
+    int width = sample_width, height = sample_height;
+    sample_size(sample.get(), width, height);
+    if (width <= 0 || height <= 0) {
+        free_sample();
+        throw std::runtime_error("Encoded sample of unknown size");
+    }
+#if XLIB_CAPTURE
+    switch_done(width, height);
+#endif
+
+    info.size.width = width;
+    info.size.height = height;
+    info.stream_start = width != (int) sample_width || height != (int) sample_height;
+    sample_width = width;
+    sample_height = height;
+}
+
+FrameInfo GstreamerFrameCapture::CaptureFrame()
+{
+    FrameInfo info;
+
+    free_sample(); // free prev if exist
+
+    if (settings.async) {
+        async_pull_sample(info);
+    } else {
+        sync_pull_sample(info);
+    }
 
     if (sample) { // map after pipeline
         if (!gst_buffer_map(gst_sample_get_buffer(sample.get()), &map, GST_MAP_READ)) {
@@ -412,6 +1478,9 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
 
 std::vector<DeviceDisplayInfo> GstreamerFrameCapture::get_device_display_info() const
 {
+#if XLIB_CAPTURE
+    std::lock_guard<std::mutex> lock(display_mutex);
+#endif
     try {
         return get_device_display_info_drm(dpy);
     } catch (const std::exception &e) {
@@ -421,11 +1490,79 @@ std::vector<DeviceDisplayInfo> GstreamerFrameCapture::get_device_display_info()
     }
 }
 
+GstreamerPlugin::~GstreamerPlugin()
+{
+    if (prewarmed.valid()) {
+        {
+            std::lock_guard<std::mutex> lock(prewarm_mutex);
+            if (prewarm_state == PrewarmState::Waiting) {
+                prewarm_state = PrewarmState::Dropped;
+            }
+        }
+        prewarm_cond.notify_all();
+        // waits for the pre-warm thread, the capture it holds goes with it
+        prewarmed.wait();
+    }
+}
+
 FrameCapture *GstreamerPlugin::CreateCapture()
 {
+    if (prewarmed.valid()) {
+        {
+            std::lock_guard<std::mutex> lock(prewarm_mutex);
+            if (prewarm_state == PrewarmState::Waiting) {
+                prewarm_state = PrewarmState::Claimed;
+            }
+        }
+        prewarm_cond.notify_all();
+        try {
+            // waits for the construction, which is at least underway
+            std::unique_ptr<GstreamerFrameCapture> capture = prewarmed.get();
+            if (capture) {
+                // drops the frames encoded ahead, the next one starts the stream
+                capture->Reset();
+                return capture.release();
+            }
+        } catch (const std::exception &e) {
+            gst_syslog(LOG_WARNING, "The pre-warmed pipeline failed: %s", e.what());
+        }
+    }
     return new GstreamerFrameCapture(settings);
 }
 
+void GstreamerPlugin::Prewarm()
+{
+    if (!settings.prewarm) {
+        return;
+    }
+    const GstreamerEncoderSettings capture_settings = settings;
+    prewarmed = std::async(std::launch::async, [this, capture_settings] {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<GstreamerFrameCapture> capture(new GstreamerFrameCapture(capture_settings));
+        capture->CaptureFrame();
+        // idle until CreateCapture resets it for a stream
+        capture->Pause();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        gst_syslog(LOG_NOTICE, "Pipeline pre-warmed in %" PRId64 " ms",
+                   (int64_t) std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+
+        // the pipeline and its threads are not kept for a stream which
+        // does not come, or which another plugin serves
+        std::unique_lock<std::mutex> lock(prewarm_mutex);
+        const auto deadline = start + std::chrono::seconds(capture_settings.prewarm_timeout);
+        if (!prewarm_cond.wait_until(lock, deadline,
+                                     [this] { return prewarm_state != PrewarmState::Waiting; })) {
+            prewarm_state = PrewarmState::Dropped;
+        }
+        if (prewarm_state == PrewarmState::Dropped) {
+            lock.unlock();
+            gst_syslog(LOG_NOTICE, "Dropping the unclaimed pre-warmed pipeline");
+            capture.reset();
+        }
+        return capture;
+    });
+}
+
 unsigned GstreamerPlugin::Rank()
 {
     return SoftwareMin;
@@ -443,6 +1580,24 @@ void GstreamerPlugin::ParseOptions(const ConfigureOption *options)
             } catch (const std::exception &e) {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'framerate'.");
             }
+        } else if (name == "change-detection") {
+            if (value == "xdamage") {
+                settings.change_detection = ChangeDetection::XDamage;
+            } else if (value == "tile-hash") {
+                settings.change_detection = ChangeDetection::TileHash;
+            } else if (value == "off") {
+                settings.change_detection = ChangeDetection::Off;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'change-detection'.");
+            }
+        } else if (name == "gst.async") {
+            if (value == "1" || value == "on") {
+                settings.async = true;
+            } else if (value == "0" || value == "off") {
+                settings.async = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.async'.");
+            }
         } else if (name == "gst.codec") {
             if (value == "h264") {
                 settings.codec = SPICE_VIDEO_CODEC_TYPE_H264;
@@ -457,6 +1612,44 @@ void GstreamerPlugin::ParseOptions(const ConfigureOption *options)
             } else {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'gst.codec'.");
             }
+        } else if (name == "gst.latency-profile") {
+            if (value == "1" || value == "on") {
+                settings.latency_profile = true;
+            } else if (value == "0" || value == "off") {
+                settings.latency_profile = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.latency-profile'.");
+            }
+        } else if (name == "gst.probe") {
+            if (value == "1" || value == "on") {
+                settings.probe = true;
+            } else if (value == "0" || value == "off") {
+                settings.probe = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.probe'.");
+            }
+        } else if (name == "gst.prewarm") {
+            if (value == "1" || value == "on") {
+                settings.prewarm = true;
+            } else if (value == "0" || value == "off") {
+                settings.prewarm = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.prewarm'.");
+            }
+        } else if (name == "gst.prewarm-timeout") {
+            try {
+                settings.prewarm_timeout = std::stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.prewarm-timeout'.");
+            }
+        } else if (name == "gst.yuv-convert") {
+            if (value == "1" || value == "on") {
+                settings.yuv_convert = true;
+            } else if (value == "0" || value == "off") {
+                settings.yuv_convert = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.yuv-convert'.");
+            }
         } else if (name == "gst.encoder") {
             settings.encoder = value;
         } else if (name == "gst.prop") {
@@ -481,6 +1674,7 @@ SPICE_STREAMING_AGENT_PLUGIN(agent)
     auto plugin = std::make_shared<GstreamerPlugin>();
 
     plugin->ParseOptions(agent->Options());
+    plugin->Prewarm();
 
     agent->Register(plugin);
 
@@ -9,85 +9,545 @@
 #include <ctype.h>
 #include <jpeglib.h>
 #include <setjmp.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#ifdef HAVE_LIBTURBOJPEG
+#include <turbojpeg.h>
+#endif
 
 #include "jpeg.hpp"
+#include <spice-streaming-agent/tile-hash.hpp>
 
-struct JpegBuffer: public jpeg_destination_mgr
-{
-    JpegBuffer(std::vector<uint8_t>& buffer);
-    ~JpegBuffer();
+using spice::streaming_agent::BlockPool;
+using spice::streaming_agent::PixelConverter;
+using spice::streaming_agent::PixelFormat;
+using spice::streaming_agent::SegmentedBuffer;
+using spice::streaming_agent::TileChangeDetector;
 
-    std::vector<uint8_t>& buffer;
-};
+#if defined(HAVE_JPEG_TURBO) || defined(HAVE_LIBTURBOJPEG)
+static const bool native_bgrx = true;
+#else
+static const bool native_bgrx = false;
+#endif
 
-static boolean buf_empty_output_buffer(j_compress_ptr cinfo)
+boolean JpegEncoder::grow_buffer(j_compress_ptr cinfo)
 {
-    JpegBuffer *buf = (JpegBuffer *) cinfo->dest;
-    size_t size = buf->buffer.size();
-    buf->buffer.resize(buf->buffer.capacity() * 2);
-    buf->next_output_byte = &buf->buffer[0] + size;
-    buf->free_in_buffer = buf->buffer.size() - size;
+    std::vector<uint8_t> &buffer = *static_cast<Destination *>(cinfo->dest)->buffer;
+    size_t size = buffer.size();
+    buffer.resize(buffer.capacity() * 2);
+    cinfo->dest->next_output_byte = &buffer[0] + size;
+    cinfo->dest->free_in_buffer = buffer.size() - size;
     return TRUE;
 }
 
-static void dummy_destination(j_compress_ptr cinfo)
+boolean JpegEncoder::next_block(j_compress_ptr cinfo)
 {
+    SegmentedBuffer &segments = *static_cast<Destination *>(cinfo->dest)->segments;
+    // the previous block is full
+    cinfo->dest->next_output_byte = segments.add_block();
+    cinfo->dest->free_in_buffer = segments.block_size();
+    return TRUE;
 }
 
-JpegBuffer::JpegBuffer(std::vector<uint8_t>& buffer):
-    buffer(buffer)
+static void dummy_destination(j_compress_ptr)
 {
-    if (buffer.capacity() < 32 * 1024) {
-        buffer.resize(32 * 1024);
-    } else {
-        buffer.resize(buffer.capacity());
-    }
-    next_output_byte = &buffer[0];
-    free_in_buffer = buffer.size();
-    init_destination = dummy_destination;
-    empty_output_buffer = buf_empty_output_buffer;
-    term_destination = dummy_destination;
 }
 
-JpegBuffer::~JpegBuffer()
+JpegEncoder::JpegEncoder():
+    pixel_format(PixelFormat::bgrx())
 {
-    buffer.resize(next_output_byte - &buffer[0]);
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    dest.init_destination = dummy_destination;
+    dest.term_destination = dummy_destination;
+    cinfo.dest = &dest;
+
+    if (!native_bgrx) {
+        converter.reset(new PixelConverter(pixel_format));
+    }
 }
 
-/* from https://github.com/LuaDist/libjpeg/blob/master/example.c */
-void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height)
+void JpegEncoder::set_pixel_format(const PixelFormat &format)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    int row_stride;
+    if (format == pixel_format) {
+        return;
+    }
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+    if (format.is_bgrx() && native_bgrx) {
+        converter.reset();
+    } else {
+        converter.reset(new PixelConverter(format));
+    }
+    pixel_format = format;
+    // the input color space changes
+    quality = -1;
+}
 
-    JpegBuffer buf(buffer);
-    cinfo.dest = &buf;
+JpegEncoder::~JpegEncoder()
+{
+#ifdef HAVE_LIBTURBOJPEG
+    if (turbo_handle) {
+        tjDestroy(turbo_handle);
+    }
+#endif
+    jpeg_destroy_compress(&cinfo);
+}
 
+void JpegEncoder::configure(int quality, unsigned width, unsigned height)
+{
     cinfo.image_width = width;
     cinfo.image_height = height;
-    cinfo.input_components = 4;
+    if (converter) {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+    } else {
+        cinfo.input_components = 4;
 #ifdef HAVE_JPEG_TURBO
-    cinfo.in_color_space = JCS_EXT_BGRX;
+        cinfo.in_color_space = JCS_EXT_BGRX;
 #endif
+    }
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
 
+    this->quality = quality;
+}
+
+#ifdef HAVE_LIBTURBOJPEG
+const uint8_t *JpegEncoder::turbo_encode(int quality, const uint8_t *data, unsigned width,
+                                         unsigned height, size_t stride, unsigned long &size)
+{
+    if (!turbo_handle) {
+        turbo_handle = tjInitCompress();
+        if (!turbo_handle) {
+            throw std::runtime_error(std::string("Cannot initialize TurboJPEG: ") + tjGetErrorStr());
+        }
+    }
+
+    // large enough for any image of this size, so tjCompress2 never
+    // reallocates it. Only the compressed part is ever written.
+    const size_t bound = tjBufSize(width, height, TJSAMP_420);
+    if (turbo_capacity < bound) {
+        turbo_buffer.reset(new uint8_t[bound]);
+        turbo_capacity = bound;
+    }
+
+    int pixel_format = TJPF_BGRX;
+    if (converter) {
+        converted.resize((size_t) width * height * 3);
+        converter->convert(data, stride, converted.data(), width, height);
+        data = converted.data();
+        stride = width * 3;
+        pixel_format = TJPF_RGB;
+    }
+
+    unsigned char *output = turbo_buffer.get();
+    size = turbo_capacity;
+    if (tjCompress2(turbo_handle, (unsigned char *) data, width, stride, height, pixel_format,
+                    &output, &size, TJSAMP_420, quality, TJFLAG_NOREALLOC) != 0) {
+        throw std::runtime_error(std::string("TurboJPEG compression failed: ") + tjGetErrorStr());
+    }
+
+    return output;
+}
+#endif
+
+void JpegEncoder::encode(std::vector<uint8_t> &buffer, int quality, const uint8_t *data,
+                         unsigned width, unsigned height, size_t stride)
+{
+    if (stride == 0) {
+        stride = (size_t) width * pixel_format.bits_per_pixel / 8;
+    }
+
+#ifdef HAVE_LIBTURBOJPEG
+    unsigned long size;
+    const uint8_t *jpeg = turbo_encode(quality, data, width, height, stride, size);
+    // only the image is copied, into the capacity the buffer already has
+    buffer.assign(jpeg, jpeg + size);
+#else
+    // write directly into the whole capacity of the buffer
+    if (buffer.capacity() < 32 * 1024) {
+        buffer.resize(32 * 1024);
+    } else {
+        buffer.resize(buffer.capacity());
+    }
+    dest.buffer = &buffer;
+    dest.empty_output_buffer = grow_buffer;
+    dest.next_output_byte = &buffer[0];
+    dest.free_in_buffer = buffer.size();
+
+    compress(quality, data, width, height, stride);
+
+    buffer.resize(dest.next_output_byte - &buffer[0]);
+    dest.buffer = nullptr;
+#endif
+}
+
+void JpegEncoder::encode(SegmentedBuffer &output, int quality, const uint8_t *data,
+                         unsigned width, unsigned height, size_t stride)
+{
+    if (stride == 0) {
+        stride = (size_t) width * pixel_format.bits_per_pixel / 8;
+    }
+
+    output.clear();
+
+#ifdef HAVE_LIBTURBOJPEG
+    unsigned long size;
+    const uint8_t *jpeg = turbo_encode(quality, data, width, height, stride, size);
+    // the image stays in turbo_buffer until the next frame
+    output.append_reference(jpeg, size);
+#else
+    dest.segments = &output;
+    dest.empty_output_buffer = next_block;
+    dest.next_output_byte = output.add_block();
+    dest.free_in_buffer = output.block_size();
+
+    compress(quality, data, width, height, stride);
+
+    output.set_tail(output.block_size() - dest.free_in_buffer);
+    dest.segments = nullptr;
+#endif
+}
+
+void JpegEncoder::compress(int quality, const uint8_t *data, unsigned width, unsigned height,
+                           size_t stride)
+{
+    if (quality != this->quality || width != cinfo.image_width || height != cinfo.image_height) {
+        configure(quality, width, height);
+    }
+
     jpeg_start_compress(&cinfo, TRUE);
 
-    row_stride = width * 4;
+    if (converter) {
+        converted.resize(width * 3);
+    }
 
+    JSAMPROW row_pointer[1];
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &data[cinfo.next_scanline * row_stride];
+        const uint8_t *line = &data[cinfo.next_scanline * stride];
+        if (converter) {
+            converter->convert_line(line, converted.data(), width);
+            line = converted.data();
+        }
+        row_pointer[0] = const_cast<uint8_t *>(line);
         // TODO check error
         (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
 
     jpeg_finish_compress(&cinfo);
+}
 
-    jpeg_destroy_compress(&cinfo);
+void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height)
+{
+    JpegEncoder encoder;
+    encoder.encode(buffer, quality, data, width, height);
+}
+
+namespace {
+
+// stripes are made of whole MCU rows for every sampling factor
+const unsigned stripe_alignment = 16;
+// the blocks the stripes are encoded into, the headers fit in the first one
+const size_t stripe_block_size = 16 * 1024;
+const size_t max_free_stripe_blocks = 256;
+
+uint16_t read_u16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+void write_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+// the layout of a JPEG image produced by libjpeg
+struct JpegLayout
+{
+    size_t sof;        // SOFn marker
+    size_t sos;        // SOS marker
+    size_t scan_data;  // entropy-coded data, up to the final EOI marker
+    unsigned mcu_width, mcu_height;
+};
+
+// the headers are in the first piece of the image
+JpegLayout parse_jpeg(const SegmentedBuffer &image)
+{
+    size_t size;
+    const uint8_t *jpeg = image.first_piece(size);
+    JpegLayout layout = {};
+    size_t pos = 2; // SOI
+    while (pos + 4 <= size && jpeg[pos] == 0xff) {
+        const uint8_t marker = jpeg[pos + 1];
+        const size_t length = read_u16(&jpeg[pos + 2]);
+        if (marker == 0xc0 || marker == 0xc1) {
+            layout.sof = pos;
+            unsigned h_max = 1, v_max = 1;
+            const unsigned components = jpeg[pos + 9];
+            for (unsigned i = 0; i < components; ++i) {
+                const uint8_t sampling = jpeg[pos + 10 + 3 * i + 1];
+                h_max = std::max(h_max, (unsigned) sampling >> 4);
+                v_max = std::max(v_max, (unsigned) sampling & 0xf);
+            }
+            layout.mcu_width = 8 * h_max;
+            layout.mcu_height = 8 * v_max;
+        } else if (marker == 0xda) {
+            layout.sos = pos;
+            layout.scan_data = pos + 2 + length;
+            if (layout.sof != 0 && layout.scan_data <= size &&
+                layout.scan_data + 2 <= image.size()) {
+                return layout;
+            }
+            break;
+        }
+        pos += 2 + length;
+    }
+    throw std::runtime_error("Unexpected JPEG layout while stitching stripes");
+}
+
+} // namespace
+
+ParallelJpegEncoder::ParallelJpegEncoder(unsigned threads) :
+    stripe_pool(std::make_shared<BlockPool>(stripe_block_size, max_free_stripe_blocks)),
+    next_stripe(0),
+    pixel_format(PixelFormat::bgrx()),
+    cached_pixel_format(PixelFormat::bgrx())
+{
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back(&ParallelJpegEncoder::worker, this);
+    }
+}
+
+ParallelJpegEncoder::~ParallelJpegEncoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cond.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ParallelJpegEncoder::set_pixel_format(const PixelFormat &format)
+{
+    // the stripes are encoded on the workers, report an unsupported format now
+    PixelConverter check(format);
+    pixel_format = format;
+}
+
+void ParallelJpegEncoder::set_stripe_cache(unsigned stripe_height)
+{
+    cache_stripe_height = stripe_height;
+    for (auto &stripe : stripes) {
+        stripe->cached = false;
+    }
+}
+
+void ParallelJpegEncoder::worker()
+{
+    uint64_t done_generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cond.wait(lock, [&] { return stopping || generation != done_generation; });
+            if (stopping) {
+                return;
+            }
+            done_generation = generation;
+        }
+
+        encode_stripes();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_workers == 0) {
+            done_cond.notify_one();
+        }
+    }
+}
+
+void ParallelJpegEncoder::encode_stripe(Stripe &stripe, SegmentedBuffer &output,
+                                        int quality, const uint8_t *data, unsigned width,
+                                        unsigned height, size_t stride)
+{
+    stripe.encoder.set_pixel_format(pixel_format);
+    stripe.encoder.encode(output, quality, data, width, height, stride);
+}
+
+void ParallelJpegEncoder::encode_stripes()
+{
+    for (;;) {
+        const unsigned index = next_stripe++;
+        if (index >= stripe_count) {
+            return;
+        }
+        const unsigned y = index * stripe_height;
+        const unsigned lines = std::min(stripe_height, height - y);
+        Stripe &stripe = *stripes[index];
+        if (hash_width) {
+            const uint64_t hash = TileChangeDetector::hash_area(data + y * stride, hash_width,
+                                                                lines, stride);
+            stripe.reused = stripe.cached && stripe.hash == hash;
+            stripe.hash = hash;
+            stripe.cached = true;
+            if (stripe.reused) {
+                continue;
+            }
+        } else {
+            stripe.cached = stripe.reused = false;
+        }
+        encode_stripe(stripe, stripe.output, quality, data + y * stride, width, lines, stride);
+    }
+}
+
+bool ParallelJpegEncoder::encode_parallel(int quality, const uint8_t *data, unsigned width,
+                                          unsigned height, size_t stride)
+{
+    if (stride == 0) {
+        stride = (size_t) width * pixel_format.bits_per_pixel / 8;
+    }
+
+    // the restart interval, in MCUs (of at least 8x8 pixels), fits in 16 bits
+    const unsigned max_stripe_height =
+        65535u / ((width + 7) / 8) * 8 / stripe_alignment * stripe_alignment;
+    unsigned stripe_height = cache_stripe_height ?
+        cache_stripe_height : (height + threads() - 1) / threads();
+    stripe_height = (stripe_height + stripe_alignment - 1) / stripe_alignment * stripe_alignment;
+    stripe_height = std::min(stripe_height, max_stripe_height);
+
+    this->stride = stride;
+    if ((workers.empty() && !cache_stripe_height) ||
+        stripe_height == 0 || stripe_height >= height) {
+        if (stripes.empty()) {
+            stripes.emplace_back(new Stripe(stripe_pool));
+        }
+        // the caller encodes the whole frame with the first stripe
+        stripes[0]->cached = false;
+        return false;
+    }
+
+    this->stripe_count = (height + stripe_height - 1) / stripe_height;
+    this->stripe_height = stripe_height;
+    this->data = data;
+    this->width = width;
+    this->height = height;
+    this->quality = quality;
+    while (stripes.size() < stripe_count) {
+        stripes.emplace_back(new Stripe(stripe_pool));
+    }
+    next_stripe = 0;
+
+    // the hashes cover whole 32 bits words of the lines
+    const size_t line_size = (size_t) width * pixel_format.bits_per_pixel / 8;
+    hash_width = cache_stripe_height && line_size % 4 == 0 ? line_size / 4 : 0;
+    if (quality != cached_quality || width != cached_width || height != cached_height ||
+        stripe_height != cached_stripe_height || pixel_format != cached_pixel_format) {
+        for (auto &stripe : stripes) {
+            stripe->cached = false;
+        }
+        cached_quality = quality;
+        cached_width = width;
+        cached_height = height;
+        cached_stripe_height = stripe_height;
+        cached_pixel_format = pixel_format;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++generation;
+        busy_workers = workers.size();
+    }
+    start_cond.notify_all();
+
+    encode_stripes();
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cond.wait(lock, [this] { return busy_workers == 0; });
+    }
+
+    if (hash_width) {
+        for (unsigned i = 0; i < stripe_count; ++i) {
+            ++(stripes[i]->reused ? cache_stats.reused : cache_stats.encoded);
+        }
+    }
+
+    return true;
+}
+
+void ParallelJpegEncoder::encode(std::vector<uint8_t> &buffer, int quality, const uint8_t *data,
+                                 unsigned width, unsigned height, size_t stride)
+{
+    if (!encode_parallel(quality, data, width, height, stride)) {
+        Stripe &stripe = *stripes[0];
+        stripe.encoder.set_pixel_format(pixel_format);
+        stripe.encoder.encode(buffer, quality, data, width, height, this->stride);
+        return;
+    }
+
+    stitch(stitched);
+    buffer.clear();
+    buffer.reserve(stitched.size());
+    for (const auto &piece : stitched.iovecs()) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(piece.iov_base);
+        buffer.insert(buffer.end(), bytes, bytes + piece.iov_len);
+    }
+}
+
+void ParallelJpegEncoder::encode(SegmentedBuffer &output, int quality, const uint8_t *data,
+                                 unsigned width, unsigned height, size_t stride)
+{
+    if (!encode_parallel(quality, data, width, height, stride)) {
+        encode_stripe(*stripes[0], output, quality, data, width, height, this->stride);
+        return;
+    }
+
+    stitch(output);
+}
+
+void ParallelJpegEncoder::stitch(SegmentedBuffer &output)
+{
+    static const uint8_t restart_markers[8][2] = {
+        { 0xff, 0xd0 }, { 0xff, 0xd1 }, { 0xff, 0xd2 }, { 0xff, 0xd3 },
+        { 0xff, 0xd4 }, { 0xff, 0xd5 }, { 0xff, 0xd6 }, { 0xff, 0xd7 },
+    };
+    static const uint8_t eoi[2] = { 0xff, 0xd9 };
+
+    const SegmentedBuffer &first_stripe = stripes[0]->output;
+    const JpegLayout layout = parse_jpeg(first_stripe);
+    size_t first_length;
+    const uint8_t *first = first_stripe.first_piece(first_length);
+    const unsigned mcu_columns = (width + layout.mcu_width - 1) / layout.mcu_width;
+    const unsigned restart_interval = mcu_columns * (stripe_height / layout.mcu_height);
+
+    // the headers of the first stripe, with the height of the whole frame
+    header.assign(first, first + layout.sos);
+    write_u16(&header[layout.sof + 5], height);
+
+    const uint8_t dri[] = { 0xff, 0xdd, 0x00, 0x04,
+                            (uint8_t) (restart_interval >> 8), (uint8_t) restart_interval };
+    header.insert(header.end(), dri, dri + sizeof(dri));
+    header.insert(header.end(), first + layout.sos, first + layout.scan_data);
+
+    // output refers to the header and the stripes, nothing else is copied
+    output.clear();
+    output.append_reference(header.data(), header.size());
+
+    // the entropy-coded data of each stripe ends on a byte boundary (padded
+    // with 1 bits) and starts with the DC predictions reset, as expected
+    // after a restart marker
+    for (unsigned i = 0; i < stripe_count; ++i) {
+        const SegmentedBuffer &stripe = stripes[i]->output;
+        const size_t scan_data = i == 0 ? layout.scan_data : parse_jpeg(stripe).scan_data;
+        output.append_reference(stripe, scan_data, stripe.size() - 2 - scan_data);
+        if (i + 1 < stripe_count) {
+            output.append_reference(restart_markers[i % 8], 2);
+        }
+    }
+
+    output.append_reference(eoi, 2);
 }
@@ -7,8 +7,206 @@
 #define SPICE_STREAMING_AGENT_JPEG_HPP
 
 #include <stdio.h>
+#include <stdint.h>
+#include <jpeglib.h>
+#include <spice-streaming-agent/pixel-format.hpp>
+#include "segmented-buffer.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+/*
+ * Compresses frames, keeping the libjpeg compressor, its tables and its
+ * destination manager across frames. The compression parameters are only
+ * set again when the size, the quality or the pixel format changes.
+ *
+ * The frames are 32 bits BGRX unless another pixel format is set. libjpeg-turbo
+ * reads BGRX frames as they are, the other formats (and BGRX with a plain
+ * libjpeg) are converted to RGB line by line.
+ *
+ * When built with the TurboJPEG API (HAVE_LIBTURBOJPEG) the frames are
+ * compressed by tjCompress2 instead, with a handle kept across frames and
+ * an output buffer sized with tjBufSize and kept by the encoder. The
+ * SegmentedBuffer refers to it, the vector receives a copy of the image.
+ */
+class JpegEncoder
+{
+public:
+    JpegEncoder();
+    JpegEncoder(const JpegEncoder &) = delete;
+    JpegEncoder &operator=(const JpegEncoder &) = delete;
+    ~JpegEncoder();
+
+    /*
+     * Sets the pixel format of the next frames. Throws an Error if the
+     * format cannot be converted.
+     */
+    void set_pixel_format(const spice::streaming_agent::PixelFormat &format);
+
+    /*
+     * Encodes a frame into buffer, which is resized to the JPEG size. The
+     * capacity of buffer is reused.
+     * stride is the distance between two lines in bytes, 0 for packed lines.
+     */
+    void encode(std::vector<uint8_t> &buffer, int quality, const uint8_t *data,
+                unsigned width, unsigned height, size_t stride = 0);
+
+    /*
+     * Encodes a frame into output, which is cleared first. libjpeg writes
+     * straight into the blocks of output, taken from its pool as needed and
+     * never zero-filled. With TurboJPEG output refers to the image in the
+     * encoder, valid until the next frame.
+     */
+    void encode(spice::streaming_agent::SegmentedBuffer &output, int quality,
+                const uint8_t *data, unsigned width, unsigned height, size_t stride = 0);
+
+private:
+    // writes either into buffer, or into segments
+    struct Destination: public jpeg_destination_mgr
+    {
+        std::vector<uint8_t> *buffer = nullptr;
+        spice::streaming_agent::SegmentedBuffer *segments = nullptr;
+    };
+
+    void configure(int quality, unsigned width, unsigned height);
+    void compress(int quality, const uint8_t *data, unsigned width, unsigned height,
+                  size_t stride);
+    static boolean grow_buffer(j_compress_ptr cinfo);
+    static boolean next_block(j_compress_ptr cinfo);
+    // returns the JPEG image, valid until the next frame
+    const uint8_t *turbo_encode(int quality, const uint8_t *data, unsigned width,
+                                unsigned height, size_t stride, unsigned long &size);
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    Destination dest;
+    int quality = -1;
+
+    spice::streaming_agent::PixelFormat pixel_format;
+    // converts the frames the encoder cannot read directly, to RGB
+    std::unique_ptr<spice::streaming_agent::PixelConverter> converter;
+    std::vector<uint8_t> converted;
+
+    // TurboJPEG backend, a tjhandle
+    void *turbo_handle = nullptr;
+    // never value-initialized nor handed out, it only grows
+    std::unique_ptr<uint8_t[]> turbo_buffer;
+    size_t turbo_capacity = 0;
+};
+
+struct StripeCacheStats
+{
+    uint64_t encoded = 0;
+    uint64_t reused = 0;
+};
+
+/*
+ * Compresses frames on several threads. The frame is split into horizontal
+ * stripes of whole MCU rows, each stripe is compressed separately and the
+ * stripes are stitched into a single baseline JPEG image, separated by
+ * restart markers (the restart interval being the number of MCUs of a
+ * stripe). The image decodes exactly like a single-threaded one.
+ *
+ * The calling thread encodes stripes too, threads - 1 workers are started.
+ *
+ * With the stripe cache enabled the stripes have a fixed height, even on a
+ * single thread, and the source pixels of each stripe are hashed. A stripe
+ * whose pixels did not change since the previous frame (of the same size,
+ * quality and pixel format) is not encoded again, its entropy-coded data
+ * is stitched as it is.
+ */
+class ParallelJpegEncoder
+{
+public:
+    explicit ParallelJpegEncoder(unsigned threads);
+    ParallelJpegEncoder(const ParallelJpegEncoder &) = delete;
+    ParallelJpegEncoder &operator=(const ParallelJpegEncoder &) = delete;
+    ~ParallelJpegEncoder();
+
+    void set_pixel_format(const spice::streaming_agent::PixelFormat &format);
+
+    void encode(std::vector<uint8_t> &buffer, int quality, const uint8_t *data,
+                unsigned width, unsigned height, size_t stride = 0);
+    /*
+     * output refers to the headers and to the stripes kept by the encoder,
+     * nothing is copied. It is valid until the next frame.
+     */
+    void encode(spice::streaming_agent::SegmentedBuffer &output, int quality,
+                const uint8_t *data, unsigned width, unsigned height, size_t stride = 0);
+
+    unsigned threads() const { return workers.size() + 1; }
+
+    /*
+     * Enables the stripe cache with stripes of about stripe_height lines
+     * (rounded to whole MCU rows), 0 disables it.
+     * Frames whose lines are not a multiple of 4 bytes are never cached.
+     */
+    void set_stripe_cache(unsigned stripe_height);
+    const StripeCacheStats &stripe_cache_stats() const { return cache_stats; }
+
+private:
+    struct Stripe
+    {
+        explicit Stripe(const std::shared_ptr<spice::streaming_agent::BlockPool> &pool) :
+            output(pool) {}
+
+        JpegEncoder encoder;
+        // in blocks of stripe_pool, or referring to the image in encoder
+        // with TurboJPEG
+        spice::streaming_agent::SegmentedBuffer output;
+        // hash of the pixels output was encoded from, if cached
+        uint64_t hash = 0;
+        bool cached = false;
+        bool reused = false;
+    };
+
+    void worker();
+    void encode_stripe(Stripe &stripe, spice::streaming_agent::SegmentedBuffer &output,
+                       int quality, const uint8_t *data, unsigned width, unsigned height,
+                       size_t stride);
+    void encode_stripes();
+    // false if the frame is too small to be split, nothing is encoded then
+    bool encode_parallel(int quality, const uint8_t *data, unsigned width, unsigned height,
+                         size_t stride);
+    void stitch(spice::streaming_agent::SegmentedBuffer &output);
+
+    std::vector<std::thread> workers;
+    std::shared_ptr<spice::streaming_agent::BlockPool> stripe_pool;
+    std::vector<std::unique_ptr<Stripe>> stripes;
+
+    std::mutex mutex;
+    std::condition_variable start_cond, done_cond;
+    uint64_t generation = 0;
+    unsigned busy_workers = 0;
+    bool stopping = false;
+
+    // the frame being encoded
+    std::atomic<unsigned> next_stripe;
+    unsigned stripe_count = 0, stripe_height = 0;
+    const uint8_t *data = nullptr;
+    size_t stride = 0;
+    unsigned width = 0, height = 0;
+    int quality = 0;
+    spice::streaming_agent::PixelFormat pixel_format;
+
+    unsigned cache_stripe_height = 0;
+    // hash_width words of each line are hashed, 0 when not caching the frame
+    unsigned hash_width = 0;
+    StripeCacheStats cache_stats;
+    // the parameters of the frame the cached stripes belong to
+    int cached_quality = -1;
+    unsigned cached_width = 0, cached_height = 0, cached_stripe_height = 0;
+    spice::streaming_agent::PixelFormat cached_pixel_format;
+
+    // the patched headers the stitched image starts with
+    std::vector<uint8_t> header;
+    // the stitched image, for the contiguous output
+    spice::streaming_agent::SegmentedBuffer stitched;
+};
+
 void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height);
 
 #endif
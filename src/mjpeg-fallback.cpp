@@ -8,8 +8,24 @@
 #include "mjpeg-fallback.hpp"
 
 #include "jpeg.hpp"
+#include "quality-controller.hpp"
+#include "frame-scaler.hpp"
+#include "segmented-buffer.hpp"
 #include <spice-streaming-agent/x11-display-info.hpp>
-
+#include <spice-streaming-agent/x11-image-capture.hpp>
+#include <spice-streaming-agent/x11-damage.hpp>
+#include <spice-streaming-agent/tile-hash.hpp>
+#include <spice-streaming-agent/frame-pacer.hpp>
+#include <spice-streaming-agent/pixel-format.hpp>
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
 #include <stdexcept>
@@ -19,21 +35,23 @@
 
 using namespace spice::streaming_agent;
 
-static inline uint64_t get_time()
-{
-    timespec now;
+namespace {
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
+// while the screen is static the last frame is sent again at this interval
+const int damage_keepalive_ms = 1000;
 
-    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+PixelFormat image_pixel_format(const XImage *image)
+{
+    return { (unsigned) image->depth, (unsigned) image->bits_per_pixel,
+             image->byte_order == MSBFirst,
+             (uint32_t) image->red_mask, (uint32_t) image->green_mask,
+             (uint32_t) image->blue_mask };
 }
 
-namespace {
-
-class MjpegFrameCapture final: public FrameCapture
+class MjpegFrameCapture final: public FrameCapture, public SegmentedFrameSource
 {
 public:
-    MjpegFrameCapture(const MjpegSettings &settings);
+    MjpegFrameCapture(const MjpegSettings &settings, Agent *agent);
     ~MjpegFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
@@ -41,29 +59,96 @@ public:
         return SPICE_VIDEO_CODEC_TYPE_MJPEG;
     }
     std::vector<DeviceDisplayInfo> get_device_display_info() const override;
+    const SegmentedBuffer &frame_segments() const override {
+        return frame;
+    }
 private:
     MjpegSettings settings;
+    Agent *const agent;
     Display *const dpy;
-
-    std::vector<uint8_t> frame;
+    std::unique_ptr<X11ImageCapture> image_capture;
+    std::unique_ptr<X11DamageTracker> damage_tracker;
+    std::unique_ptr<TileChangeDetector> tile_detector;
+    FramePacer pacer;
+    ParallelJpegEncoder encoder;
+    QualityController quality;
+
+    // the JPEG frame, written by the encoder into blocks that are recycled
+    // from frame to frame
+    SegmentedBuffer frame;
+    // the downscaled frame being encoded
+    std::vector<uint8_t> scaled;
+    bool downscale_warned = false;
 
     // last frame sizes
     int last_width = -1, last_height = -1;
-    // last time before capture
-    uint64_t last_time = 0;
 };
 
 }
 
-MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings):
-    settings(settings),dpy(XOpenDisplay(nullptr))
+// a positive dimension ending at end, strtoul alone accepts a sign
+static bool parse_dimension(const char *text, char end, unsigned &dimension)
+{
+    if (!isdigit((unsigned char) *text)) {
+        return false;
+    }
+    char *stop;
+    errno = 0;
+    const unsigned long value = strtoul(text, &stop, 10);
+    if (errno || *stop != end || value == 0 || value > UINT_MAX) {
+        return false;
+    }
+    dimension = value;
+    return true;
+}
+
+static size_t frame_budget(const MjpegSettings &settings)
+{
+    if (settings.frame_budget) {
+        return settings.frame_budget;
+    }
+    return settings.bitrate / 8 / std::max(settings.fps, 1);
+}
+
+MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings, Agent *agent):
+    settings(settings),agent(agent),dpy(XOpenDisplay(nullptr)),pacer(settings.fps),
+    encoder(settings.threads),
+    quality(settings.quality, settings.min_quality, settings.max_quality, frame_budget(settings)),
+    frame(std::make_shared<BlockPool>())
 {
     if (!dpy)
         throw std::runtime_error("Unable to initialize X11");
+
+    encoder.set_stripe_cache(settings.stripe_cache);
+
+    image_capture.reset(new X11ImageCapture(dpy));
+
+    if (settings.change_detection == ChangeDetection::XDamage) {
+        try {
+            damage_tracker.reset(new X11DamageTracker(dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+        } catch (const Error &e) {
+            syslog(LOG_WARNING, "%s, capturing every frame", e.what());
+        }
+    } else if (settings.change_detection == ChangeDetection::TileHash) {
+        tile_detector.reset(new TileChangeDetector());
+    }
 }
 
 MjpegFrameCapture::~MjpegFrameCapture()
 {
+    const FramePacerStats &stats = pacer.stats();
+    syslog(LOG_DEBUG, "MJPEG frame pacing: %" PRIu64 " frames, %" PRIu64 " missed deadlines, "
+           "%" PRIu64 " skipped frames, jitter avg %" PRIu64 " us max %" PRIu64 " us",
+           stats.frames, stats.missed, stats.skipped,
+           stats.frames ? stats.total_jitter_ns / stats.frames / 1000 : 0,
+           stats.max_jitter_ns / 1000);
+    const StripeCacheStats &cache_stats = encoder.stripe_cache_stats();
+    syslog(LOG_DEBUG, "MJPEG stripe cache: %" PRIu64 " stripes encoded, %" PRIu64 " reused",
+           cache_stats.encoded, cache_stats.reused);
+
+    // the shared memory segment must be released before the display
+    image_capture.reset();
+    damage_tracker.reset();
     XCloseDisplay(dpy);
 }
 
@@ -71,6 +156,11 @@ void MjpegFrameCapture::Reset()
 {
     frame.clear();
     last_width = last_height = -1;
+    if (tile_detector) {
+        tile_detector->reset();
+    }
+    // the time between the streams is not late frames
+    pacer.reset();
 }
 
 FrameInfo MjpegFrameCapture::CaptureFrame()
@@ -78,25 +168,21 @@ FrameInfo MjpegFrameCapture::CaptureFrame()
     FrameInfo info;
 
     // reduce speed considering FPS
-    auto now = get_time();
-    if (last_time == 0) {
-        last_time = now;
-    } else {
-        const uint64_t delta = 1000000000u / settings.fps;
-        if (now >= last_time + delta) {
-            last_time = now;
-        } else {
-            uint64_t wait_time = last_time + delta - now;
-            // mathematically wait_time must be less than a second as
-            // delta would be 1 seconds only for FPS == 1 but in this
-            // side of the if now < last_time + delta
-            // but is also true that now > last_time so
-            // last_time + delta > now > last_time so
-            // 1s >= delta > now - last_time > 0 so
-            // wait_time = delta - (now - last_time) < delta <= 1s
-            timespec delay = { 0, (long) wait_time };
-            nanosleep(&delay, NULL);
-            last_time += delta;
+    pacer.wait();
+
+    if (damage_tracker && !frame.empty()) {
+        const bool damaged = damage_tracker->wait_for_damage(damage_keepalive_ms);
+        // the screen may have been static for a while
+        pacer.resync();
+        if (!damaged) {
+            // nothing changed on screen, send the previous frame again
+            // without capturing and encoding it
+            info.size.width = last_width;
+            info.size.height = last_height;
+            info.buffer = nullptr;
+            info.buffer_size = frame.size();
+            info.stream_start = false;
+            return info;
         }
     }
 
@@ -107,29 +193,69 @@ FrameInfo MjpegFrameCapture::CaptureFrame()
     XWindowAttributes win_info;
     XGetWindowAttributes(dpy, win, &win_info);
 
+    if (damage_tracker) {
+        // changes happening from now on are reported for the next frame
+        damage_tracker->take_damage();
+    }
+
+    XImage *image = image_capture->capture(win, win_info.x, win_info.y,
+                                           win_info.width, win_info.height);
+
+    unsigned factor = downscale_factor(image->width, image->height, settings.downscale,
+                                       settings.max_width, settings.max_height);
+    if (factor > 1 && image->bits_per_pixel != 32) {
+        if (!downscale_warned) {
+            syslog(LOG_WARNING, "Cannot downscale frames of %d bits per pixel",
+                   image->bits_per_pixel);
+            downscale_warned = true;
+        }
+        factor = 1;
+    }
+
+    // the stream has the size of the encoded frames
+    const int width = image->width / factor, height = image->height / factor;
     bool is_first = false;
-    if (win_info.width != last_width || win_info.height != last_height) {
-        last_width = win_info.width;
-        last_height = win_info.height;
+    if (width != last_width || height != last_height) {
+        last_width = width;
+        last_height = height;
         is_first = true;
     }
 
-    info.size.width = win_info.width;
-    info.size.height = win_info.height;
-
-    int format = ZPixmap;
-    // TODO handle errors
-    XImage *image = XGetImage(dpy, win, win_info.x, win_info.y,
-                              win_info.width, win_info.height, AllPlanes, format);
+    info.size.width = width;
+    info.size.height = height;
+
+    // the previous frame is sent again when no tile changed, the tiles are
+    // hashed as 32 bits words whatever the pixel size, only the whole frame
+    // matters here
+    const unsigned hash_width = (image->width * image->bits_per_pixel + 31) / 32;
+    const bool unchanged = tile_detector &&
+        tile_detector->update((uint8_t*) image->data, hash_width, image->height,
+                              image->bytes_per_line) == 0;
+
+    if (!unchanged || frame.empty()) {
+        // TODO handle errors
+        const uint8_t *data = (uint8_t*) image->data;
+        size_t stride = image->bytes_per_line;
+        if (factor > 1) {
+            scaled.resize((size_t) width * height * 4);
+            downscale_frame(data, stride, image->width, image->height, factor, scaled.data());
+            data = scaled.data();
+            stride = width * 4;
+        }
 
-    // TODO handle errors
-    // TODO multiple formats (only 32 bit)
-    write_JPEG_file(frame, settings.quality, (uint8_t*) image->data,
-                    image->width, image->height);
+        encoder.set_pixel_format(image_pixel_format(image));
+        encoder.encode(frame, quality.quality(), data, width, height, stride);
 
-    image->f.destroy_image(image);
+        const int previous_quality = quality.quality();
+        if (quality.update(frame.size()) && agent) {
+            agent->LogStat("MJPEG quality %d -> %d, average frame %zu bytes, budget %zu bytes",
+                           previous_quality, quality.quality(), quality.average(),
+                           quality.budget());
+        }
+    }
 
-    info.buffer = &frame[0];
+    // the frame is in frame_segments()
+    info.buffer = nullptr;
     info.buffer_size = frame.size();
 
     info.stream_start = is_first;
@@ -150,7 +276,7 @@ std::vector<DeviceDisplayInfo> MjpegFrameCapture::get_device_display_info() cons
 
 FrameCapture *MjpegPlugin::CreateCapture()
 {
-    return new MjpegFrameCapture(settings);
+    return new MjpegFrameCapture(settings, agent);
 }
 
 unsigned MjpegPlugin::Rank()
@@ -170,12 +296,80 @@ void MjpegPlugin::ParseOptions(const ConfigureOption *options)
             } catch (const std::exception &e) {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'framerate'.");
             }
+        } else if (name == "change-detection") {
+            if (value == "xdamage") {
+                settings.change_detection = ChangeDetection::XDamage;
+            } else if (value == "tile-hash") {
+                settings.change_detection = ChangeDetection::TileHash;
+            } else if (value == "off") {
+                settings.change_detection = ChangeDetection::Off;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'change-detection'.");
+            }
+        } else if (name == "mjpeg.threads") {
+            try {
+                settings.threads = std::max(1, stoi(value));
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.threads'.");
+            }
         } else if (name == "mjpeg.quality") {
             try {
                 settings.quality = stoi(value);
             } catch (const std::exception &e) {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.quality'.");
             }
+        } else if (name == "mjpeg.downscale") {
+            try {
+                settings.downscale = stoi(value);
+            } catch (const std::exception &e) {
+                settings.downscale = 0;
+            }
+            if (settings.downscale < 1 || settings.downscale > 8) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.downscale'.");
+            }
+        } else if (name == "mjpeg.max-size") {
+            unsigned max_width, max_height;
+            const size_t x = value.find('x');
+            if (x == std::string::npos ||
+                !parse_dimension(value.c_str(), 'x', max_width) ||
+                !parse_dimension(value.c_str() + x + 1, '\0', max_height)) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.max-size'.");
+            }
+            settings.max_width = max_width;
+            settings.max_height = max_height;
+        } else if (name == "mjpeg.stripe-cache") {
+            try {
+                settings.stripe_cache = stoul(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.stripe-cache'.");
+            }
+        } else if (name == "mjpeg.bitrate") {
+            try {
+                settings.bitrate = stoul(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.bitrate'.");
+            }
+        } else if (name == "mjpeg.frame-budget") {
+            try {
+                settings.frame_budget = stoul(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.frame-budget'.");
+            }
+        } else if (name == "mjpeg.min-quality" || name == "mjpeg.max-quality") {
+            int bound;
+            try {
+                bound = stoi(value);
+            } catch (const std::exception &e) {
+                bound = 0;
+            }
+            if (bound < 1 || bound > 100) {
+                throw std::runtime_error("Invalid value '" + value + "' for option '" + name + "'.");
+            }
+            if (name == "mjpeg.min-quality") {
+                settings.min_quality = bound;
+            } else {
+                settings.max_quality = bound;
+            }
         }
     }
 }
@@ -192,6 +386,7 @@ SpiceVideoCodecType MjpegPlugin::VideoCodecType() const {
 bool MjpegPlugin::Register(Agent* agent)
 {
     auto plugin = std::make_shared<MjpegPlugin>();
+    plugin->agent = agent;
 
     try {
         plugin->ParseOptions(agent->Options());
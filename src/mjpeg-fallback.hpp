@@ -13,10 +13,37 @@
 namespace spice {
 namespace streaming_agent {
 
+enum class ChangeDetection
+{
+    /// capture and encode every frame
+    Off,
+    /// skip frames while XDamage reports no change on screen
+    XDamage,
+    /// skip encoding frames whose tile hashes did not change
+    TileHash,
+};
+
 struct MjpegSettings
 {
-    int fps;
-    int quality;
+    int fps = 10;
+    int quality = 80;
+    ChangeDetection change_detection = ChangeDetection::XDamage;
+    unsigned threads = 1;
+    /// target bitrate in bits per second, 0 for a fixed quality
+    unsigned bitrate = 0;
+    /// target size of a frame in bytes, takes precedence over bitrate
+    unsigned frame_budget = 0;
+    /// bounds of the quality when it adapts to the bitrate
+    int min_quality = 10;
+    int max_quality = 95;
+    /// frames are encoded downscaled by this factor, at least
+    int downscale = 1;
+    /// frames are downscaled to fit in this size, 0 for no limit
+    unsigned max_width = 0;
+    unsigned max_height = 0;
+    /// height of the stripes whose encoding is reused while their pixels
+    /// do not change, 0 to encode the whole frames
+    unsigned stripe_cache = 32;
 };
 
 class MjpegPlugin final: public Plugin
@@ -29,7 +56,8 @@ public:
     SpiceVideoCodecType VideoCodecType() const override;
     static bool Register(Agent* agent);
 private:
-    MjpegSettings settings = { 10, 80 };
+    MjpegSettings settings;
+    Agent *agent = nullptr;
 };
 
 }} // namespace spice::streaming_agent
@@ -0,0 +1,280 @@
+/* Conversion of the captured pixel formats to RGB.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/pixel-format.hpp>
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_FORMAT_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/*
+ * Channels of less than 8 bits are expanded by replicating their bits
+ * (r5 -> r5 r5[4:2]), so that black and white stay black and white. The SIMD
+ * kernels expand them the same way.
+ */
+inline uint8_t expand_channel(uint32_t value, unsigned bits)
+{
+    if (bits >= 8) {
+        return value >> (bits - 8);
+    }
+    uint32_t result = 0;
+    int shift = 8 - bits;
+    for (; shift > 0; shift -= bits) {
+        result |= value << shift;
+    }
+    return result | (value >> -shift);
+}
+
+struct Channel
+{
+    unsigned shift, bits;
+
+    explicit Channel(uint32_t mask):
+        shift(__builtin_ctz(mask)),
+        bits(__builtin_popcount(mask))
+    {}
+
+    uint8_t extract(uint32_t pixel) const
+    {
+        return expand_channel((pixel >> shift) & ((1ull << bits) - 1), bits);
+    }
+};
+
+bool is_bgr24(const PixelFormat &format)
+{
+    return format.bits_per_pixel == 24 && !format.big_endian && format.red_mask == 0xff0000 &&
+        format.green_mask == 0xff00 && format.blue_mask == 0xff;
+}
+
+bool is_rgb565(const PixelFormat &format)
+{
+    return format.bits_per_pixel == 16 && !format.big_endian && format.red_mask == 0xf800 &&
+        format.green_mask == 0x07e0 && format.blue_mask == 0x001f;
+}
+
+// any TrueColor format, masks and byte order taken from the format
+void convert_generic(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &format)
+{
+    const Channel red(format.red_mask), green(format.green_mask), blue(format.blue_mask);
+    const unsigned bytes = format.bits_per_pixel / 8;
+
+    for (unsigned x = 0; x < width; ++x, src += bytes, dst += 3) {
+        uint32_t pixel = 0;
+        for (unsigned i = 0; i < bytes; ++i) {
+            const unsigned byte = format.big_endian ? i : bytes - 1 - i;
+            pixel = (pixel << 8) | src[byte];
+        }
+        dst[0] = red.extract(pixel);
+        dst[1] = green.extract(pixel);
+        dst[2] = blue.extract(pixel);
+    }
+}
+
+void bgrx_scalar(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &)
+{
+    for (unsigned x = 0; x < width; ++x, src += 4, dst += 3) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+void bgr24_scalar(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &)
+{
+    for (unsigned x = 0; x < width; ++x, src += 3, dst += 3) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+void rgb565_scalar(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &)
+{
+    for (unsigned x = 0; x < width; ++x, src += 2, dst += 3) {
+        const unsigned pixel = src[0] | (src[1] << 8);
+        const unsigned r = pixel >> 11, g = (pixel >> 5) & 0x3f, b = pixel & 0x1f;
+        dst[0] = (r << 3) | (r >> 2);
+        dst[1] = (g << 2) | (g >> 4);
+        dst[2] = (b << 3) | (b >> 2);
+    }
+}
+
+#if PIXEL_FORMAT_X86
+__attribute__((target("ssse3")))
+void bgrx_ssse3(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &format)
+{
+    // 4 pixels to 12 bytes in the low part of the register
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                          -1, -1, -1, -1);
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16, src += 64, dst += 48) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) src), shuffle);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 16)), shuffle);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 32)), shuffle);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 48)), shuffle);
+        _mm_storeu_si128((__m128i *) dst, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128((__m128i *) (dst + 16),
+                         _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+        _mm_storeu_si128((__m128i *) (dst + 32),
+                         _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+    }
+    bgrx_scalar(src, dst, width - x, format);
+}
+
+__attribute__((target("avx2")))
+void bgrx_avx2(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &format)
+{
+    // 4 pixels to 12 bytes in each lane, then the 24 bytes are gathered at
+    // the bottom of the register
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                             -1, -1, -1, -1,
+                                             2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                             -1, -1, -1, -1);
+    const __m256i gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    unsigned x = 0;
+    // each store writes 8 bytes past the 24 converted ones, they are
+    // overwritten by the next iteration
+    for (; x + 11 <= width; x += 8, src += 32, dst += 24) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) src), shuffle);
+        _mm256_storeu_si256((__m256i *) dst, _mm256_permutevar8x32_epi32(v, gather));
+    }
+    bgrx_ssse3(src, dst, width - x, format);
+}
+
+__attribute__((target("ssse3")))
+void bgr24_ssse3(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &format)
+{
+    // 5 pixels per register, the last byte is overwritten by the next
+    // iteration
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    unsigned x = 0;
+    for (; x + 6 <= width; x += 5, src += 15, dst += 15) {
+        __m128i v = _mm_loadu_si128((const __m128i *) src);
+        _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(v, shuffle));
+    }
+    bgr24_scalar(src, dst, width - x, format);
+}
+
+__attribute__((target("ssse3")))
+void rgb565_ssse3(const uint8_t *src, uint8_t *dst, unsigned width, const PixelFormat &format)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f), mask6 = _mm_set1_epi16(0x3f);
+    // the first 16 bytes from the red/green pairs and the blue bytes
+    const __m128i rg_low = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+    const __m128i b_low = _mm_setr_epi8(-1, -1, 0, -1, -1, 2, -1, -1, 4, -1, -1, 6, -1, -1, 8, -1);
+    // the last 8 bytes
+    const __m128i rg_high = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_high = _mm_setr_epi8(-1, 10, -1, -1, 12, -1, -1, 14,
+                                         -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8, src += 16, dst += 24) {
+        __m128i v = _mm_loadu_si128((const __m128i *) src);
+        __m128i r = _mm_srli_epi16(v, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+        __m128i b = _mm_and_si128(v, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i *) dst,
+                         _mm_or_si128(_mm_shuffle_epi8(rg, rg_low), _mm_shuffle_epi8(b, b_low)));
+        _mm_storel_epi64((__m128i *) (dst + 16),
+                         _mm_or_si128(_mm_shuffle_epi8(rg, rg_high), _mm_shuffle_epi8(b, b_high)));
+    }
+    rgb565_scalar(src, dst, width - x, format);
+}
+#endif
+
+} // namespace
+
+bool PixelFormat::is_bgrx() const
+{
+    return bits_per_pixel == 32 && !big_endian && red_mask == 0xff0000 &&
+        green_mask == 0xff00 && blue_mask == 0xff;
+}
+
+bool PixelFormat::operator==(const PixelFormat &other) const
+{
+    return depth == other.depth && bits_per_pixel == other.bits_per_pixel &&
+        big_endian == other.big_endian && red_mask == other.red_mask &&
+        green_mask == other.green_mask && blue_mask == other.blue_mask;
+}
+
+SimdLevel PixelConverter::supported_kernel(SimdLevel kernel)
+{
+    return select_simd_level(kernel, {SimdLevel::SSSE3, SimdLevel::AVX2});
+}
+
+static SimdLevel select_kernel(const PixelFormat &format, SimdLevel kernel)
+{
+    kernel = PixelConverter::supported_kernel(kernel);
+    if (!format.is_bgrx() && kernel == SimdLevel::AVX2) {
+        // only BGRX has an AVX2 kernel
+        kernel = SimdLevel::SSSE3;
+    }
+    if (!format.is_bgrx() && !is_bgr24(format) && !is_rgb565(format)) {
+        kernel = SimdLevel::Scalar;
+    }
+    return kernel;
+}
+
+PixelConverter::PixelConverter(const PixelFormat &format, SimdLevel kernel):
+    pixel_format(format),
+    kernel_used(select_kernel(format, kernel))
+{
+    if ((format.bits_per_pixel != 16 && format.bits_per_pixel != 24 &&
+         format.bits_per_pixel != 32) || format.depth > format.bits_per_pixel ||
+        !format.red_mask || !format.green_mask || !format.blue_mask) {
+        throw Error("Unsupported pixel format: depth " + std::to_string(format.depth) +
+                    ", " + std::to_string(format.bits_per_pixel) + " bits per pixel");
+    }
+
+    line_function = convert_generic;
+    if (format.is_bgrx()) {
+        line_function = bgrx_scalar;
+    } else if (is_bgr24(format)) {
+        line_function = bgr24_scalar;
+    } else if (is_rgb565(format)) {
+        line_function = rgb565_scalar;
+    }
+
+#if PIXEL_FORMAT_X86
+    if (kernel_used == SimdLevel::AVX2) {
+        line_function = bgrx_avx2;
+    } else if (kernel_used == SimdLevel::SSSE3) {
+        if (format.is_bgrx()) {
+            line_function = bgrx_ssse3;
+        } else if (is_bgr24(format)) {
+            line_function = bgr24_ssse3;
+        } else {
+            line_function = rgb565_ssse3;
+        }
+    }
+#endif
+}
+
+void PixelConverter::convert(const uint8_t *src, size_t stride, uint8_t *dst,
+                             unsigned width, unsigned height) const
+{
+    for (unsigned y = 0; y < height; ++y, src += stride, dst += width * 3) {
+        line_function(src, dst, width, pixel_format);
+    }
+}
+
+}} // namespace spice::streaming_agent
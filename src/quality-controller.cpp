@@ -0,0 +1,74 @@
+/* Adaptive JPEG quality.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "quality-controller.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// weight of the last frame in the moving average
+const double average_weight = 0.2;
+// frames encoded with a quality before deciding to change it
+const unsigned settle_frames = 3;
+// the quality goes down above budget * high_margin, up below
+// budget * low_margin
+const double high_margin = 1.2;
+const double low_margin = 0.7;
+// largest quality changes at once, going up is slower to avoid oscillating
+const int max_step_down = 15;
+const int max_step_up = 5;
+
+}
+
+QualityController::QualityController(int quality, int min_quality, int max_quality,
+                                     size_t frame_budget):
+    min_quality(std::max(1, min_quality)),
+    max_quality(std::max(this->min_quality, std::min(100, max_quality))),
+    frame_budget(frame_budget),
+    current(frame_budget ? std::min(std::max(quality, this->min_quality), this->max_quality)
+                         : quality)
+{
+}
+
+bool QualityController::update(size_t frame_size)
+{
+    if (frame_budget == 0) {
+        return false;
+    }
+
+    if (samples == 0) {
+        average_size = frame_size;
+    } else {
+        average_size += (frame_size - average_size) * average_weight;
+    }
+    if (++samples < settle_frames) {
+        return false;
+    }
+
+    const double ratio = average_size / frame_budget;
+    int quality = current;
+    if (ratio > high_margin) {
+        quality -= std::min(max_step_down, std::max(1, (int) std::lround((ratio - 1) * 15)));
+    } else if (ratio < low_margin) {
+        quality += std::min(max_step_up, std::max(1, (int) std::lround((1 - ratio) * 10)));
+    }
+    quality = std::min(std::max(quality, min_quality), max_quality);
+
+    if (quality == current) {
+        return false;
+    }
+    current = quality;
+    samples = 0;
+    return true;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,56 @@
+/* Adaptive JPEG quality.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+#ifndef SPICE_STREAMING_AGENT_QUALITY_CONTROLLER_HPP
+#define SPICE_STREAMING_AGENT_QUALITY_CONTROLLER_HPP
+
+#include <cstddef>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Moves the JPEG quality so that the encoded frames stay around a byte
+ * budget per frame.
+ *
+ * The controller follows a moving average of the encoded sizes. The quality
+ * goes down as soon as the average exceeds the budget by more than a margin
+ * and goes up, more slowly, once it is well below the budget; in between the
+ * quality does not move. After a change the average restarts from the frames
+ * encoded with the new quality.
+ */
+class QualityController
+{
+public:
+    /*!
+     * \param quality the initial quality, clamped to the bounds
+     * \param frame_budget the target size of a frame in bytes, 0 keeps the
+     * quality fixed
+     */
+    QualityController(int quality, int min_quality, int max_quality, size_t frame_budget);
+
+    int quality() const { return current; }
+    size_t budget() const { return frame_budget; }
+    size_t average() const { return (size_t) average_size; }
+
+    /*!
+     * Accounts for a frame encoded with the current quality.
+     * \return true if the quality changed
+     */
+    bool update(size_t frame_size);
+
+private:
+    const int min_quality, max_quality;
+    const size_t frame_budget;
+    int current;
+    double average_size = 0;
+    // frames accounted in the average since the last change
+    unsigned samples = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_QUALITY_CONTROLLER_HPP
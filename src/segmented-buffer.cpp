@@ -0,0 +1,217 @@
+/* Frames stored in chains of recycled blocks.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "segmented-buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+
+namespace spice {
+namespace streaming_agent {
+
+BlockPool::BlockPool(size_t block_size, size_t max_free_blocks) :
+    size(block_size),
+    max_free_blocks(max_free_blocks)
+{
+}
+
+std::unique_ptr<uint8_t[]> BlockPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_blocks.empty()) {
+            std::unique_ptr<uint8_t[]> block = std::move(free_blocks.back());
+            free_blocks.pop_back();
+            return block;
+        }
+        ++allocated_blocks;
+    }
+    // not value-initialized, the memory is not zero-filled
+    return std::unique_ptr<uint8_t[]>(new uint8_t[size]);
+}
+
+void BlockPool::release(std::unique_ptr<uint8_t[]> &&block)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_blocks.size() < max_free_blocks) {
+        free_blocks.push_back(std::move(block));
+    } else {
+        --allocated_blocks;
+        block.reset();
+    }
+}
+
+size_t BlockPool::allocated() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocated_blocks;
+}
+
+SegmentedBuffer::SegmentedBuffer(const std::shared_ptr<BlockPool> &pool) :
+    pool(pool)
+{
+}
+
+SegmentedBuffer::SegmentedBuffer(SegmentedBuffer &&other) :
+    pool(std::move(other.pool)),
+    blocks(std::move(other.blocks)),
+    total_size(other.total_size)
+{
+    other.blocks.clear();
+    other.total_size = 0;
+}
+
+SegmentedBuffer &SegmentedBuffer::operator=(SegmentedBuffer &&other)
+{
+    if (this != &other) {
+        clear();
+        pool = std::move(other.pool);
+        blocks = std::move(other.blocks);
+        total_size = other.total_size;
+        other.blocks.clear();
+        other.total_size = 0;
+    }
+    return *this;
+}
+
+SegmentedBuffer::~SegmentedBuffer()
+{
+    clear();
+}
+
+void SegmentedBuffer::clear()
+{
+    for (auto &block : blocks) {
+        if (block.data) {
+            pool->release(std::move(block.data));
+        }
+    }
+    blocks.clear();
+    total_size = 0;
+}
+
+BlockPool &SegmentedBuffer::block_pool() const
+{
+    if (!pool) {
+        throw std::logic_error("The SegmentedBuffer has no pool to take blocks from");
+    }
+    return *pool;
+}
+
+size_t SegmentedBuffer::block_size() const
+{
+    return block_pool().block_size();
+}
+
+uint8_t *SegmentedBuffer::add_block()
+{
+    BlockPool &pool = block_pool();
+    std::unique_ptr<uint8_t[]> data = pool.acquire();
+    uint8_t *bytes = data.get();
+    blocks.push_back({std::move(data), pool.block_size(), bytes});
+    total_size += pool.block_size();
+    return bytes;
+}
+
+void SegmentedBuffer::set_tail(size_t used)
+{
+    Block &tail = blocks.back();
+    total_size = total_size - tail.used + used;
+    tail.used = used;
+}
+
+void SegmentedBuffer::append(const void *data, size_t length)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    const size_t block_size = length > 0 ? this->block_size() : 0;
+    while (length > 0) {
+        // a reference is never written to
+        if (blocks.empty() || !blocks.back().data || blocks.back().used == block_size) {
+            add_block();
+            set_tail(0);
+        }
+        Block &tail = blocks.back();
+        const size_t chunk = std::min(length, block_size - tail.used);
+        memcpy(tail.data.get() + tail.used, bytes, chunk);
+        tail.used += chunk;
+        total_size += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+}
+
+void SegmentedBuffer::append_reference(const void *data, size_t length)
+{
+    if (length > 0) {
+        blocks.push_back({nullptr, length, static_cast<const uint8_t *>(data)});
+        total_size += length;
+    }
+}
+
+void SegmentedBuffer::append_reference(const SegmentedBuffer &source, size_t offset,
+                                       size_t length)
+{
+    for (const auto &block : source.blocks) {
+        if (length == 0) {
+            break;
+        }
+        if (offset >= block.used) {
+            offset -= block.used;
+            continue;
+        }
+        const size_t chunk = std::min(length, block.used - offset);
+        append_reference(block.bytes + offset, chunk);
+        offset = 0;
+        length -= chunk;
+    }
+}
+
+std::vector<iovec> SegmentedBuffer::iovecs() const
+{
+    std::vector<iovec> iov;
+    iov.reserve(blocks.size());
+    for (const auto &block : blocks) {
+        if (block.used) {
+            iov.push_back({const_cast<uint8_t *>(block.bytes), block.used});
+        }
+    }
+    return iov;
+}
+
+const uint8_t *SegmentedBuffer::first_piece(size_t &length) const
+{
+    for (const auto &block : blocks) {
+        if (block.used) {
+            length = block.used;
+            return block.bytes;
+        }
+    }
+    length = 0;
+    return nullptr;
+}
+
+SegmentedBuffer SegmentedBuffer::clone() const
+{
+    SegmentedBuffer copy(pool);
+    for (const auto &block : blocks) {
+        copy.append(block.bytes, block.used);
+    }
+    return copy;
+}
+
+std::vector<uint8_t> SegmentedBuffer::to_vector() const
+{
+    std::vector<uint8_t> data;
+    data.reserve(total_size);
+    for (const auto &block : blocks) {
+        data.insert(data.end(), block.bytes, block.bytes + block.used);
+    }
+    return data;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,155 @@
+/* Frames stored in chains of recycled blocks.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+#ifndef SPICE_STREAMING_AGENT_SEGMENTED_BUFFER_HPP
+#define SPICE_STREAMING_AGENT_SEGMENTED_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/uio.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Fixed size blocks of uninitialized memory. Released blocks are kept for
+ * the next acquire() instead of being freed, up to a limit.
+ *
+ * Blocks can be acquired and released from any thread.
+ */
+class BlockPool
+{
+public:
+    explicit BlockPool(size_t block_size = 64 * 1024, size_t max_free_blocks = 64);
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    std::unique_ptr<uint8_t[]> acquire();
+    void release(std::unique_ptr<uint8_t[]> &&block);
+
+    size_t block_size() const { return size; }
+    // number of blocks allocated so far, for statistics
+    size_t allocated() const;
+
+private:
+    const size_t size;
+    const size_t max_free_blocks;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<uint8_t[]>> free_blocks;
+    size_t allocated_blocks = 0;
+};
+
+/*!
+ * A buffer made of a chain of blocks of a BlockPool, written sequentially.
+ * The blocks go back to the pool when the buffer is cleared or destroyed.
+ * Pieces of memory owned elsewhere can be chained too, see append_reference().
+ *
+ * A buffer without a pool (default-constructed or moved from) is empty and
+ * has no blocks to write to: add_block(), append() and block_size() throw
+ * std::logic_error, it only takes references or a buffer moved into it.
+ *
+ * The content is never copied to a contiguous buffer, iovecs() gives the
+ * pieces to write with writev().
+ */
+class SegmentedBuffer
+{
+public:
+    SegmentedBuffer() = default;
+    explicit SegmentedBuffer(const std::shared_ptr<BlockPool> &pool);
+    SegmentedBuffer(SegmentedBuffer &&other);
+    SegmentedBuffer &operator=(SegmentedBuffer &&other);
+    ~SegmentedBuffer();
+
+    /*!
+     * Releases all the blocks, the buffer is empty.
+     */
+    void clear();
+
+    /*!
+     * Adds a new block at the end of the buffer, its whole size counting as
+     * used until set_tail() is called.
+     * \return the block, of block_size() bytes
+     */
+    uint8_t *add_block();
+
+    /*!
+     * Sets the number of bytes used in the last block.
+     */
+    void set_tail(size_t used);
+
+    /*!
+     * Copies data at the end of the buffer, adding blocks as needed.
+     */
+    void append(const void *data, size_t length);
+
+    /*!
+     * Adds a piece referring to data owned by someone else, which must stay
+     * valid and unchanged as long as the buffer uses it. Nothing is copied,
+     * clone() gives a copy in owned blocks.
+     */
+    void append_reference(const void *data, size_t length);
+
+    /*!
+     * Refers to length bytes of source from offset, which must stay valid
+     * and unchanged as long as the buffer uses them.
+     */
+    void append_reference(const SegmentedBuffer &source, size_t offset, size_t length);
+
+    size_t size() const { return total_size; }
+    bool empty() const { return total_size == 0; }
+    size_t block_size() const;
+
+    std::vector<iovec> iovecs() const;
+
+    /*!
+     * \return the first piece of the buffer and its length, null when empty
+     */
+    const uint8_t *first_piece(size_t &length) const;
+
+    /*!
+     * \return a copy of the content in blocks of the same pool
+     */
+    SegmentedBuffer clone() const;
+
+    /*!
+     * Copies the content to a contiguous buffer, for the tests and the logs.
+     */
+    std::vector<uint8_t> to_vector() const;
+
+private:
+    BlockPool &block_pool() const;
+
+    struct Block
+    {
+        // null for a reference
+        std::unique_ptr<uint8_t[]> data;
+        size_t used;
+        const uint8_t *bytes;
+    };
+
+    std::shared_ptr<BlockPool> pool;
+    std::vector<Block> blocks;
+    size_t total_size = 0;
+};
+
+/*!
+ * Implemented by the captures producing their frames in a SegmentedBuffer.
+ * FrameInfo::buffer is then null, the frame is written to the port straight
+ * from the blocks of frame_segments(), valid until the next capture.
+ */
+class SegmentedFrameSource
+{
+public:
+    virtual ~SegmentedFrameSource() = default;
+    virtual const SegmentedBuffer &frame_segments() const = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_SEGMENTED_BUFFER_HPP
@@ -0,0 +1,47 @@
+/* Detection of the SIMD instruction sets of the CPU.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/simd.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+bool cpu_supports(SimdLevel level)
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    switch (level) {
+    case SimdLevel::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SimdLevel::SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case SimdLevel::AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return true;
+    }
+#else
+    return level == SimdLevel::Scalar || level == SimdLevel::Best;
+#endif
+}
+
+SimdLevel select_simd_level(SimdLevel requested, std::initializer_list<SimdLevel> implemented)
+{
+    SimdLevel selected = SimdLevel::Scalar;
+    for (SimdLevel level : implemented) {
+        if (level <= requested && level > selected && cpu_supports(level)) {
+            selected = level;
+        }
+    }
+    return selected;
+}
+
+}} // namespace spice::streaming_agent
@@ -9,6 +9,8 @@
 #include "cursor-updater.hpp"
 #include "frame-log.hpp"
 #include "stream-port.hpp"
+#include "bounded-queue.hpp"
+#include "segmented-buffer.hpp"
 #include "utils.hpp"
 #include <spice-streaming-agent/error.hpp>
 
@@ -17,6 +19,9 @@
 
 #include <spice-streaming-agent/frame-capture.hpp>
 #include <spice-streaming-agent/plugin.hpp>
+#include <spice-streaming-agent/x11-damage.hpp>
+
+#include <X11/Xlib.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +37,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <algorithm>
+#include <deque>
 #include <exception>
 #include <stdexcept>
 #include <memory>
@@ -51,14 +57,14 @@ public:
         return sizeof(PayloadType);
     }
 
-    void write_message_body(StreamPort &stream_port, unsigned w, unsigned h, uint8_t c)
+    void write_message_body(MessageBuffers &buffers, unsigned w, unsigned h, uint8_t c)
     {
         StreamMsgFormat msg{};
         msg.width = w;
         msg.height = h;
         msg.codec = c;
 
-        stream_port.write(&msg, sizeof(msg));
+        buffers.append_copy(&msg, sizeof(msg));
     }
 };
 
@@ -72,9 +78,24 @@ public:
         return sizeof(PayloadType) + length;
     }
 
-    void write_message_body(StreamPort &stream_port, const void *frame, size_t length)
+    void write_message_body(MessageBuffers &buffers, const void *frame, size_t length)
+    {
+        buffers.append(frame, length);
+    }
+
+    FrameMessage(const SegmentedBuffer &frame) : OutboundMessage(frame) {}
+
+    static size_t size(const SegmentedBuffer &frame)
     {
-        stream_port.write(frame, length);
+        return sizeof(PayloadType) + frame.size();
+    }
+
+    // the blocks are referenced, not copied
+    void write_message_body(MessageBuffers &buffers, const SegmentedBuffer &frame)
+    {
+        for (const auto &iov : frame.iovecs()) {
+            buffers.append(iov.iov_base, iov.iov_len);
+        }
     }
 };
 
@@ -86,7 +107,7 @@ public:
         return sizeof(PayloadType);
     }
 
-    void write_message_body(StreamPort &stream_port)
+    void write_message_body(MessageBuffers &buffers)
     {
         // No body for capabilities message
     }
@@ -104,7 +125,7 @@ public:
                1;
     }
 
-    void write_message_body(StreamPort &stream_port, const DeviceDisplayInfo &info)
+    void write_message_body(MessageBuffers &buffers, const DeviceDisplayInfo &info)
     {
         std::string device_address = info.device_address;
         if (device_address.length() > max_device_address_len) {
@@ -117,8 +138,8 @@ public:
         strm_msg_info.stream_id = info.stream_id;
         strm_msg_info.device_display_id = info.device_display_id;
         strm_msg_info.device_address_len = device_address.length() + 1;
-        stream_port.write(&strm_msg_info, sizeof(strm_msg_info));
-        stream_port.write(device_address.c_str(), device_address.length() + 1);
+        buffers.append_copy(&strm_msg_info, sizeof(strm_msg_info));
+        buffers.append_copy(device_address.c_str(), device_address.length() + 1);
     }
 
 private:
@@ -128,6 +149,22 @@ private:
 static bool streaming_requested = false;
 static bool quit_requested = false;
 static std::set<SpiceVideoCodecType> client_codecs;
+// time of the START request, 0 once the first frame of the stream is sent
+static uint64_t start_request_time = 0;
+
+/* Reports the time from the START request to the first frame, which
+ * includes building the capture.
+ */
+static void first_frame_sent(FrameLog &frame_log)
+{
+    if (!start_request_time) {
+        return;
+    }
+    const uint64_t elapsed = FrameLog::get_time() - start_request_time;
+    start_request_time = 0;
+    syslog(LOG_INFO, "first frame sent %" PRIu64 " ms after the START request", elapsed / 1000);
+    frame_log.log_stat("First frame sent %" PRIu64 " us after the START request", elapsed);
+}
 
 static bool have_something_to_read(StreamPort &stream_port, bool blocking)
 {
@@ -167,6 +204,9 @@ static void read_command_from_device(StreamPort &stream_port)
     }
     case STREAM_TYPE_START_STOP: {
         StartStopMessage msg = in_message.get_payload<StartStopMessage>();
+        if (msg.start_streaming && !streaming_requested) {
+            start_request_time = FrameLog::get_time();
+        }
         streaming_requested = msg.start_streaming;
         client_codecs = msg.client_codecs;
 
@@ -219,20 +259,312 @@ static void usage(const char *progname)
     printf("\t--log-binary -- log binary frames (following -l)\n");
     printf("\t--log-categories -- log categories, separated by ':' (currently: frames)\n");
     printf("\t--plugins-dir=path -- change plugins directory\n");
+    printf("\t--pipeline-depth=N -- capture and send frames in separate threads, queuing up to N frames\n");
+    printf("\t--send-queue=N -- do not wait for a busy port, queue up to N frames replacing the stale ones\n");
     printf("\t-d -- enable debug logs\n");
     printf("\t-c variable=value -- change settings\n");
     printf("\t\tframerate = 1-100 (check 10,20,30,40,50,60)\n");
+    printf("\t\tchange-detection = xdamage|tile-hash|off (skip frames while the screen is static)\n");
+    printf("\t\tmjpeg.threads = N (encode MJPEG frames as N stripes in parallel)\n");
+    printf("\t\tmjpeg.downscale = 1-8 (encode MJPEG frames downscaled by this factor)\n");
+    printf("\t\tmjpeg.max-size = WxH (downscale MJPEG frames by the factor needed to fit)\n");
+    printf("\t\tmjpeg.stripe-cache = N (reuse the encoding of unchanged stripes of N lines, 0 for off)\n");
+    printf("\t\tmjpeg.bitrate = N (adapt the MJPEG quality to N bits per second)\n");
+    printf("\t\tmjpeg.frame-budget = N (adapt the MJPEG quality to N bytes per frame)\n");
+    printf("\t\tmjpeg.min-quality, mjpeg.max-quality = 1-100 (bounds of the adapted quality)\n");
     printf("\n");
     printf("\t-h or --help     -- print this help message\n");
 
     exit(1);
 }
 
+static void send_format(StreamPort &stream_port, FrameLog &frame_log,
+                        unsigned width, unsigned height, uint8_t codec)
+{
+    syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", width, height, codec);
+    frame_log.log_stat("Started new stream wXh %uX%u codec=%u", width, height, codec);
+
+    stream_port.send<FormatMessage>(width, height, codec);
+}
+
+struct CapturedFrame
+{
+    FrameSize size;
+    bool stream_start;
+    SegmentedBuffer data;
+    /// set instead of the frame when the capture stage failed
+    std::exception_ptr error;
+};
+
+/*
+ * Frames waiting for the port in the non-blocking send mode.
+ *
+ * Frames are written without blocking the capture, a frame only partially
+ * accepted by the port is finished before the next one. While the port is
+ * busy at most `max_frames` frames wait; when there are more, the oldest
+ * (stale) ones are dropped for MJPEG, other codecs cannot lose frames and
+ * wait for the port instead.
+ */
+class OutboundFrameQueue
+{
+public:
+    OutboundFrameQueue(StreamPort &stream_port, FrameLog &frame_log, uint8_t codec,
+                       size_t max_frames);
+    OutboundFrameQueue(const OutboundFrameQueue &) = delete;
+    OutboundFrameQueue &operator=(const OutboundFrameQueue &) = delete;
+    ~OutboundFrameQueue();
+
+    void push(CapturedFrame &&frame);
+
+private:
+    void pump();
+    void log_stats();
+
+    StreamPort &stream_port;
+    FrameLog &frame_log;
+    const uint8_t codec;
+    const size_t max_frames;
+    const bool can_drop;
+    std::deque<CapturedFrame> frames;
+    FrameSize format_size = {0, 0};
+
+    uint64_t queued = 0;
+    uint64_t sent = 0;
+    // replaced by a newer frame while the port was busy
+    uint64_t dropped_port_busy = 0;
+    // still queued when the stream stopped or the port failed
+    uint64_t dropped_stream_end = 0;
+    // frames the capture waited for the port
+    uint64_t waited_port_busy = 0;
+};
+
+OutboundFrameQueue::OutboundFrameQueue(StreamPort &stream_port, FrameLog &frame_log,
+                                       uint8_t codec, size_t max_frames) :
+    stream_port(stream_port),
+    frame_log(frame_log),
+    codec(codec),
+    max_frames(max_frames ? max_frames : 1),
+    can_drop(codec == SPICE_VIDEO_CODEC_TYPE_MJPEG)
+{
+}
+
+OutboundFrameQueue::~OutboundFrameQueue()
+{
+    dropped_stream_end += frames.size();
+    try {
+        // a message cannot be left half written
+        stream_port.flush(true);
+    } catch (const WriteError &e) {
+        utils::syslog(e);
+    }
+    log_stats();
+}
+
+void OutboundFrameQueue::log_stats()
+{
+    frame_log.log_stat("Send queue: %" PRIu64 " queued, %" PRIu64 " sent, "
+                       "%" PRIu64 " dropped (port busy), %" PRIu64 " dropped (stream end), "
+                       "%" PRIu64 " waits for the port",
+                       queued, sent, dropped_port_busy, dropped_stream_end, waited_port_busy);
+    syslog(LOG_DEBUG, "Send queue: %" PRIu64 " queued, %" PRIu64 " sent, "
+           "%" PRIu64 " dropped (port busy), %" PRIu64 " dropped (stream end), "
+           "%" PRIu64 " waits for the port",
+           queued, sent, dropped_port_busy, dropped_stream_end, waited_port_busy);
+}
+
+// writes the queued frames until the port would block
+void OutboundFrameQueue::pump()
+{
+    while (stream_port.flush(false) && !frames.empty()) {
+        CapturedFrame frame = std::move(frames.front());
+        frames.pop_front();
+
+        MessageBuffers buffers;
+        // the frame starting the stream may have been dropped, send the
+        // format whenever the size changes
+        if (frame.stream_start ||
+            frame.size.width != format_size.width || frame.size.height != format_size.height) {
+            syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", frame.size.width, frame.size.height, codec);
+            frame_log.log_stat("Started new stream wXh %uX%u codec=%u",
+                               frame.size.width, frame.size.height, codec);
+            buffers.append_message<FormatMessage>(frame.size.width, frame.size.height, codec);
+            format_size = frame.size;
+        }
+        buffers.append_message<FrameMessage>(frame.data);
+        buffers.hold(std::move(frame.data));
+
+        stream_port.try_send(std::move(buffers));
+        frame_log.log_stat("Sent frame");
+        first_frame_sent(frame_log);
+        if (++sent % 100 == 0) {
+            log_stats();
+        }
+    }
+}
+
+void OutboundFrameQueue::push(CapturedFrame &&frame)
+{
+    frames.push_back(std::move(frame));
+    ++queued;
+    pump();
+
+    while (frames.size() > max_frames) {
+        if (can_drop) {
+            // a stream start must not get lost with the frame
+            const bool stream_start = frames.front().stream_start;
+            frames.pop_front();
+            frames.front().stream_start |= stream_start;
+            ++dropped_port_busy;
+            frame_log.log_stat("Dropped stale frame, port busy");
+        } else {
+            ++waited_port_busy;
+            stream_port.flush(true);
+            pump();
+        }
+    }
+}
+
+/*
+ * Copies a frame out of the plugin, which reuses its buffer for the next
+ * capture, into recycled blocks.
+ */
+static SegmentedBuffer
+copy_frame(FrameCapture &capture, const FrameInfo &info, const std::shared_ptr<BlockPool> &pool)
+{
+    if (auto source = dynamic_cast<SegmentedFrameSource *>(&capture)) {
+        return source->frame_segments().clone();
+    }
+    SegmentedBuffer data(pool);
+    data.append(info.buffer, info.buffer_size);
+    return data;
+}
+
+/*
+ * Streams with the capture (and encoding, which the plugins do in
+ * CaptureFrame) running in its own thread, so that the next frame is
+ * captured while the previous one is written to the port. The two stages
+ * are joined by a queue of at most `depth` frames.
+ */
+static void
+stream_pipelined(StreamPort &stream_port, FrameLog &frame_log, FrameCapture &capture,
+                 unsigned depth, unsigned send_queue_size)
+{
+    const uint8_t codec = capture.VideoCodecType();
+    // dropping frames is only harmless when each frame is coded independently,
+    // otherwise the capture stage waits for the port
+    const OverflowPolicy policy = codec == SPICE_VIDEO_CODEC_TYPE_MJPEG ?
+        OverflowPolicy::DropOldest : OverflowPolicy::Block;
+    BoundedQueue<CapturedFrame> queue(depth, policy);
+    auto pool = std::make_shared<BlockPool>();
+
+    std::thread capture_stage([&capture, &frame_log, &queue, &pool] {
+        try {
+            for (;;) {
+                frame_log.log_stat("Capturing frame...");
+                FrameInfo info = capture.CaptureFrame();
+                frame_log.log_stat("Captured frame");
+
+                CapturedFrame frame;
+                frame.size = info.size;
+                frame.stream_start = info.stream_start;
+                frame.data = copy_frame(capture, info, pool);
+                if (!queue.push(std::move(frame))) {
+                    return;
+                }
+            }
+        } catch (...) {
+            CapturedFrame failure{};
+            failure.error = std::current_exception();
+            queue.push(std::move(failure));
+        }
+    });
+
+    // stop the capture stage whichever way we leave
+    struct StageGuard {
+        BoundedQueue<CapturedFrame> &queue;
+        std::thread &thread;
+        ~StageGuard() {
+            queue.close();
+            thread.join();
+        }
+    } stage_guard{queue, capture_stage};
+
+    std::unique_ptr<OutboundFrameQueue> send_queue;
+    if (send_queue_size > 0) {
+        send_queue.reset(new OutboundFrameQueue(stream_port, frame_log, codec, send_queue_size));
+    }
+
+    unsigned int frame_count = 0;
+    FrameSize format_size = {0, 0};
+    while (!quit_requested && streaming_requested) {
+        CapturedFrame frame;
+        if (!queue.pop(frame)) {
+            break;
+        }
+        if (frame.error) {
+            std::rethrow_exception(frame.error);
+        }
+
+        if (send_queue) {
+            frame_log.log_stat("Frame of %zu bytes", frame.data.size());
+            frame_log.log_frame(frame.data);
+            try {
+                send_queue->push(std::move(frame));
+            } catch (const WriteError& e) {
+                utils::syslog(e);
+                break;
+            }
+            read_command(stream_port, false);
+            continue;
+        }
+
+        // the frame starting the stream may have been dropped, send the
+        // format whenever the size changes
+        if (frame.stream_start ||
+            frame.size.width != format_size.width || frame.size.height != format_size.height) {
+            send_format(stream_port, frame_log, frame.size.width, frame.size.height, codec);
+            format_size = frame.size;
+        }
+        frame_log.log_stat("Frame of %zu bytes", frame.data.size());
+        frame_log.log_frame(frame.data);
+
+        try {
+            stream_port.send<FrameMessage>(frame.data);
+        } catch (const WriteError& e) {
+            utils::syslog(e);
+            break;
+        }
+        frame_log.log_stat("Sent frame");
+        first_frame_sent(frame_log);
+
+        if (++frame_count % 100 == 0) {
+            QueueStats stats = queue.stats();
+            syslog(LOG_DEBUG, "SENT %u frames, capture queue: %zu queued (max %zu), "
+                   "%" PRIu64 " captured, %" PRIu64 " dropped",
+                   frame_count, stats.occupancy, stats.max_occupancy,
+                   stats.pushed, stats.dropped);
+        }
+
+        read_command(stream_port, false);
+    }
+
+    QueueStats stats = queue.stats();
+    frame_log.log_stat("Capture queue: %" PRIu64 " captured, %" PRIu64 " sent, "
+                       "%" PRIu64 " dropped, max %zu queued",
+                       stats.pushed, stats.popped, stats.dropped, stats.max_occupancy);
+}
+
 static void
-do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
+do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent,
+           unsigned pipeline_depth, unsigned send_queue_size)
 {
     unsigned int frame_count = 0;
+    std::unique_ptr<FrameCapture> capture;
     while (!quit_requested) {
+        // the capture of the stopped stream is kept, but idle
+        if (auto pausable = dynamic_cast<PausableCapture *>(capture.get())) {
+            pausable->Pause();
+        }
         while (!quit_requested && !streaming_requested) {
             read_command(stream_port, true);
         }
@@ -244,7 +576,9 @@ do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
         syslog(LOG_INFO, "streaming starts now");
         uint64_t time_last = 0;
 
-        std::unique_ptr<FrameCapture> capture(agent.GetBestFrameCapture(client_codecs));
+        // the capture of the previous stream is reset rather than built
+        // again, unless another plugin is now the best for the client
+        agent.RenewFrameCapture(client_codecs, capture);
         if (!capture) {
             throw std::runtime_error("cannot find a suitable capture system");
         }
@@ -275,6 +609,20 @@ do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
             syslog(LOG_ERR, "Empty device display info from the plugin");
         }
 
+        if (pipeline_depth > 0) {
+            stream_pipelined(stream_port, frame_log, *capture, pipeline_depth, send_queue_size);
+            continue;
+        }
+
+        std::unique_ptr<OutboundFrameQueue> send_queue;
+        if (send_queue_size > 0) {
+            send_queue.reset(new OutboundFrameQueue(stream_port, frame_log,
+                                                    capture->VideoCodecType(), send_queue_size));
+        }
+        // frames in blocks are sent without being copied
+        auto source = dynamic_cast<SegmentedFrameSource *>(capture.get());
+        auto pool = std::make_shared<BlockPool>();
+
         while (!quit_requested && streaming_requested) {
             if (++frame_count % 100 == 0) {
                 syslog(LOG_DEBUG, "SENT %d frames", frame_count);
@@ -294,6 +642,26 @@ do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
                    (time_before - time_last));
             time_last = time_after;
 
+            if (send_queue) {
+                // the buffer belongs to the plugin until the next capture
+                CapturedFrame queued;
+                queued.size = frame.size;
+                queued.stream_start = frame.stream_start;
+                queued.data = copy_frame(*capture, frame, pool);
+
+                frame_log.log_stat("Frame of %zu bytes", frame.buffer_size);
+                frame_log.log_frame(queued.data);
+                try {
+                    send_queue->push(std::move(queued));
+                } catch (const WriteError& e) {
+                    utils::syslog(e);
+                    break;
+                }
+
+                read_command(stream_port, false);
+                continue;
+            }
+
             if (frame.stream_start) {
                 unsigned width, height;
                 unsigned char codec;
@@ -302,21 +670,27 @@ do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
                 height = frame.size.height;
                 codec = capture->VideoCodecType();
 
-                syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", width, height, codec);
-                frame_log.log_stat("Started new stream wXh %uX%u codec=%u", width, height, codec);
-
-                stream_port.send<FormatMessage>(width, height, codec);
+                send_format(stream_port, frame_log, width, height, codec);
             }
             frame_log.log_stat("Frame of %zu bytes", frame.buffer_size);
-            frame_log.log_frame(frame.buffer, frame.buffer_size);
+            if (source) {
+                frame_log.log_frame(source->frame_segments());
+            } else {
+                frame_log.log_frame(frame.buffer, frame.buffer_size);
+            }
 
             try {
-                stream_port.send<FrameMessage>(frame.buffer, frame.buffer_size);
+                if (source) {
+                    stream_port.send<FrameMessage>(source->frame_segments());
+                } else {
+                    stream_port.send<FrameMessage>(frame.buffer, frame.buffer_size);
+                }
             } catch (const WriteError& e) {
                 utils::syslog(e);
                 break;
             }
             frame_log.log_stat("Sent frame");
+            first_frame_sent(frame_log);
 
             read_command(stream_port, false);
         }
@@ -331,14 +705,20 @@ int main(int argc, char* argv[])
     bool log_binary = false;
     bool log_frames = false;
     const char *pluginsdir = PLUGINSDIR;
+    unsigned pipeline_depth = 0;
+    unsigned send_queue_size = 0;
     enum {
         OPT_first = UCHAR_MAX,
         OPT_PLUGINS_DIR,
         OPT_LOG_BINARY,
         OPT_LOG_CATEGORIES,
+        OPT_PIPELINE_DEPTH,
+        OPT_SEND_QUEUE,
     };
     static const struct option long_options[] = {
         { "plugins-dir", required_argument, NULL, OPT_PLUGINS_DIR},
+        { "pipeline-depth", required_argument, NULL, OPT_PIPELINE_DEPTH},
+        { "send-queue", required_argument, NULL, OPT_SEND_QUEUE},
         { "log-binary", no_argument, NULL, OPT_LOG_BINARY},
         { "log-categories", required_argument, NULL, OPT_LOG_CATEGORIES},
         { "help", no_argument, NULL, 'h'},
@@ -351,6 +731,10 @@ int main(int argc, char* argv[])
 
     setlogmask(LOG_UPTO(LOG_NOTICE));
 
+    // the plugins capture from their own threads and displays, while the
+    // main thread keeps using Xlib for the cursor
+    XInitThreads();
+
     std::vector<ConcreteConfigureOption> options;
 
     while ((opt = getopt_long(argc, argv, "hp:c:l:d", long_options, NULL)) != -1) {
@@ -361,6 +745,22 @@ int main(int argc, char* argv[])
         case OPT_PLUGINS_DIR:
             pluginsdir = optarg;
             break;
+        case OPT_PIPELINE_DEPTH:
+            try {
+                pipeline_depth = std::stoul(optarg);
+            } catch (const std::exception &e) {
+                syslog(LOG_ERR, "Invalid '--pipeline-depth' argument value: %s", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case OPT_SEND_QUEUE:
+            try {
+                send_queue_size = std::stoul(optarg);
+            } catch (const std::exception &e) {
+                syslog(LOG_ERR, "Invalid '--send-queue' argument value: %s", optarg);
+                usage(argv[0]);
+            }
+            break;
         case 'p':
             stream_port_name = optarg;
             break;
@@ -416,11 +816,13 @@ int main(int argc, char* argv[])
         old_args.clear();
 
         StreamPort stream_port(stream_port_name);
+        // the captures waiting for changes on screen return for the commands
+        X11DamageTracker::set_wakeup_fd(stream_port.fd);
 
         std::thread cursor_updater{CursorUpdater(&stream_port)};
         cursor_updater.detach();
 
-        do_capture(stream_port, frame_log, agent);
+        do_capture(stream_port, frame_log, agent, pipeline_depth, send_queue_size);
     }
     catch (std::exception &err) {
         syslog(LOG_ERR, "%s", err.what());
@@ -12,6 +12,8 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <limits.h>
+#include <algorithm>
 #include <stdexcept>
 
 
@@ -82,6 +84,41 @@ NotifyErrorMessage InboundMessage::get_payload<NotifyErrorMessage>()
     return msg;
 }
 
+void MessageBuffers::append(const void *buf, size_t len)
+{
+    pieces.push_back({buf, 0, len});
+}
+
+void MessageBuffers::hold(std::vector<uint8_t> &&data)
+{
+    // moving the vector keeps its data where it is
+    owned.push_back(std::move(data));
+}
+
+void MessageBuffers::hold(SegmentedBuffer &&data)
+{
+    // the blocks do not move either
+    owned_segments.push_back(std::move(data));
+}
+
+void MessageBuffers::append_copy(const void *buf, size_t len)
+{
+    pieces.push_back({nullptr, storage.size(), len});
+    storage.insert(storage.end(), (const uint8_t *) buf, (const uint8_t *) buf + len);
+}
+
+std::vector<iovec> MessageBuffers::iovecs() const
+{
+    // the copies are resolved last, storage may have moved while appending
+    std::vector<iovec> iov;
+    iov.reserve(pieces.size());
+    for (const auto &piece : pieces) {
+        const void *base = piece.buf ? piece.buf : storage.data() + piece.offset;
+        iov.push_back({const_cast<void *>(base), piece.len});
+    }
+    return iov;
+}
+
 StreamPort::StreamPort(const std::string &port_name) : fd(open(port_name.c_str(), O_RDWR | O_NONBLOCK))
 {
     if (fd < 0) {
@@ -89,6 +126,10 @@ StreamPort::StreamPort(const std::string &port_name) : fd(open(port_name.c_str()
     }
 }
 
+StreamPort::StreamPort(int fd) : fd(fd)
+{
+}
+
 StreamPort::~StreamPort()
 {
     close(fd);
@@ -121,6 +162,63 @@ void StreamPort::write(const void *buf, size_t len)
     write_all(fd, buf, len);
 }
 
+void StreamPort::write(const MessageBuffers &buffers)
+{
+    write_pending(true);
+    std::vector<iovec> iov = buffers.iovecs();
+    writev_all(fd, iov.data(), iov.size());
+}
+
+bool StreamPort::try_send(MessageBuffers &&buffers)
+{
+    std::lock_guard<std::mutex> stream_guard(mutex);
+    if (!write_pending(false)) {
+        throw std::logic_error("A message is already pending on the stream port");
+    }
+    pending = std::move(buffers);
+    pending_iov = pending.iovecs();
+    pending_index = 0;
+    return write_pending(false);
+}
+
+bool StreamPort::flush(bool blocking)
+{
+    std::lock_guard<std::mutex> stream_guard(mutex);
+    return write_pending(blocking);
+}
+
+bool StreamPort::write_pending(bool blocking)
+{
+    if (pending_index >= pending_iov.size()) {
+        return true;
+    }
+
+    iovec *iov = &pending_iov[pending_index];
+    size_t count = pending_iov.size() - pending_index;
+    try {
+        if (blocking) {
+            writev_all(fd, iov, count);
+            count = 0;
+        } else {
+            writev_some(fd, iov, count);
+        }
+    } catch (...) {
+        // the message cannot be completed, do not write its end
+        pending_iov.clear();
+        pending_index = 0;
+        pending = MessageBuffers();
+        throw;
+    }
+    pending_index = pending_iov.size() - count;
+    if (count > 0) {
+        return false;
+    }
+    pending_iov.clear();
+    pending_index = 0;
+    pending = MessageBuffers();
+    return true;
+}
+
 void read_all(int fd, void *buf, size_t len)
 {
     while (len > 0) {
@@ -160,39 +258,79 @@ void read_all(int fd, void *buf, size_t len)
     }
 }
 
-void write_all(int fd, const void *buf, size_t len)
+// waits for the device to accept more data
+static void wait_writable(int fd)
 {
-    while (len > 0) {
-        ssize_t n = write(fd, buf, len);
+    for (;;) {
+        struct pollfd pollfd = {fd, POLLOUT, 0};
+        if (poll(&pollfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        if (n < 0) {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                struct pollfd pollfd = {fd, POLLOUT, 0};
-                if (poll(&pollfd, 1, -1) < 0) {
-                    if (errno == EINTR) {
-                        continue;
-                    }
+            throw WriteError("poll failed while writing message to device", errno);
+        }
 
-                    throw WriteError("poll failed while writing message to device", errno);
-                }
+        if (pollfd.revents & POLLOUT) {
+            return;
+        }
 
-                if (pollfd.revents & POLLOUT) {
-                    continue;
-                }
+        if (pollfd.revents & POLLHUP) {
+            throw WriteError("Writing message to device failed: The device is closed.");
+        }
 
-                if (pollfd.revents & POLLHUP) {
-                    throw WriteError("Writing message to device failed: The device is closed.");
-                }
+        throw WriteError("Writing message to device failed: poll returned " +
+                         std::to_string(pollfd.revents));
+    }
+}
+
+void write_all(int fd, const void *buf, size_t len)
+{
+    iovec iov = {const_cast<void *>(buf), len};
+    writev_all(fd, &iov, 1);
+}
+
+void writev_all(int fd, iovec *iov, size_t count)
+{
+    while (!writev_some(fd, iov, count)) {
+        wait_writable(fd);
+    }
+}
 
-                throw WriteError("Writing message to device failed: poll returned " +
-                                 std::to_string(pollfd.revents));
+/*
+ * Writes the buffers until the device would block. On return iov and count
+ * describe what is left to write.
+ * @return true if everything was written
+ */
+bool writev_some(int fd, iovec *&iov, size_t &count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, std::min(count, (size_t) IOV_MAX));
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
             }
             throw WriteError("Writing message to device failed", errno);
         }
 
-        len -= n;
-        buf = (uint8_t *) buf + n;
+        // drop the buffers fully written and advance into the partial one,
+        // the iovec array is modified in place
+        size_t written = n;
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
+    return true;
 }
 
 }} // namespace spice::streaming_agent
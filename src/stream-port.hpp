@@ -12,11 +12,15 @@
 
 #include <spice-streaming-agent/error.hpp>
 
+#include "segmented-buffer.hpp"
+
 #include <cstddef>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <vector>
+#include <sys/uio.h>
 
 
 namespace spice {
@@ -75,9 +79,50 @@ InCapabilitiesMessage InboundMessage::get_payload<InCapabilitiesMessage>();
 template<>
 NotifyErrorMessage InboundMessage::get_payload<NotifyErrorMessage>();
 
+/*
+ * The pieces of one or more outbound messages, written at once with writev().
+ *
+ * Large buffers (frames, cursor pixels) are referenced and must stay valid
+ * until the message is written, or held by the buffers. Small
+ * ones built on the stack by the message are copied.
+ */
+class MessageBuffers
+{
+public:
+    void append(const void *buf, size_t len);
+    void append_copy(const void *buf, size_t len);
+
+    template <typename Message, typename ...PayloadArgs>
+    void append_message(PayloadArgs&&... payload_args)
+    {
+        Message message(payload_args...);
+        message.write_header(*this);
+        message.write_message_body(*this, payload_args...);
+    }
+
+    // keeps data referenced by append() alive as long as the buffers
+    void hold(std::vector<uint8_t> &&data);
+    void hold(SegmentedBuffer &&data);
+
+    std::vector<iovec> iovecs() const;
+
+private:
+    struct Piece {
+        const void *buf; // nullptr for the copies
+        size_t offset;   // of the copies in storage
+        size_t len;
+    };
+    std::vector<Piece> pieces;
+    std::vector<uint8_t> storage;
+    std::vector<std::vector<uint8_t>> owned;
+    std::vector<SegmentedBuffer> owned_segments;
+};
+
 class StreamPort {
 public:
     StreamPort(const std::string &port_name);
+    // takes the ownership of an open non-blocking descriptor
+    explicit StreamPort(int fd);
     ~StreamPort();
 
     InboundMessage receive();
@@ -85,18 +130,39 @@ public:
     template <typename Message, typename ...PayloadArgs>
     void send(PayloadArgs&&... payload_args)
     {
-        Message message(payload_args...);
+        MessageBuffers buffers;
+        buffers.append_message<Message>(payload_args...);
+
         std::lock_guard<std::mutex> stream_guard(mutex);
-        message.write_header(*this);
-        message.write_message_body(*this, payload_args...);
+        write(buffers);
     }
 
+    /*
+     * Writes the messages as far as the port accepts them without blocking.
+     * The rest is kept and written by flush(), or before any other message.
+     * Only one message can be pending at a time.
+     * @return true if everything was written
+     */
+    bool try_send(MessageBuffers &&buffers);
+
+    /*
+     * Writes the rest of a message started by try_send().
+     * @return true if nothing is pending anymore
+     */
+    bool flush(bool blocking);
+
     void write(const void *buf, size_t len);
+    void write(const MessageBuffers &buffers);
 
     const int fd;
 
 private:
+    bool write_pending(bool blocking);
+
     std::mutex mutex;
+    MessageBuffers pending;
+    std::vector<iovec> pending_iov;
+    size_t pending_index = 0;
 };
 
 template <typename Payload, typename Message, unsigned Type>
@@ -111,9 +177,9 @@ public:
         hdr.size = (uint32_t) Message::size(payload_args...);
     }
 
-    void write_header(StreamPort &stream_port)
+    void write_header(MessageBuffers &buffers)
     {
-        stream_port.write(&hdr, sizeof(hdr));
+        buffers.append_copy(&hdr, sizeof(hdr));
     }
 
 protected:
@@ -123,6 +189,8 @@ protected:
 
 void read_all(int fd, void *buf, size_t len);
 void write_all(int fd, const void *buf, size_t len);
+void writev_all(int fd, iovec *iov, size_t count);
+bool writev_some(int fd, iovec *&iov, size_t &count);
 
 }} // namespace spice::streaming_agent
 
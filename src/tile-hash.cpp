@@ -0,0 +1,268 @@
+/* Software change detection based on tile hashes.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/tile-hash.hpp>
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TILE_HASH_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/*
+ * The hash of an area keeps 8 lanes of 32 bits. Each line of the area is read
+ * by blocks of 8 pixels, pixel i of a block being mixed into lane i with
+ *     lane = rotl(lane ^ pixel, 7) + pixel
+ * The pixels left at the end of a line (when the width is not a multiple of 8)
+ * are mixed the same way after the blocks of the line. The SIMD kernels
+ * process all the lanes of a block at once and produce exactly the same lanes
+ * as the scalar one.
+ *
+ * The kernels hash a line of several adjacent areas at once so that a band of
+ * tiles is read sequentially, one frame line after the other.
+ */
+const unsigned block_pixels = 8;
+
+typedef void HashLineFunc(const uint8_t *line, unsigned areas, unsigned area_blocks,
+                          uint32_t *lanes);
+
+inline uint32_t mix_pixel(uint32_t lane, uint32_t pixel)
+{
+    lane ^= pixel;
+    return ((lane << 7) | (lane >> 25)) + pixel;
+}
+
+void hash_line_scalar(const uint8_t *line, unsigned areas, unsigned area_blocks,
+                      uint32_t *lanes)
+{
+    for (unsigned a = 0; a < areas; ++a, lanes += 8) {
+        for (unsigned b = 0; b < area_blocks; ++b, line += block_pixels * 4) {
+            for (unsigned i = 0; i < block_pixels; ++i) {
+                uint32_t pixel;
+                memcpy(&pixel, line + i * 4, 4);
+                lanes[i] = mix_pixel(lanes[i], pixel);
+            }
+        }
+    }
+}
+
+#if TILE_HASH_X86
+__attribute__((target("sse2")))
+void hash_line_sse2(const uint8_t *line, unsigned areas, unsigned area_blocks,
+                    uint32_t *lanes)
+{
+    for (unsigned a = 0; a < areas; ++a, lanes += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) lanes);
+        __m128i hi = _mm_loadu_si128((const __m128i *) (lanes + 4));
+        for (unsigned b = 0; b < area_blocks; ++b, line += block_pixels * 4) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) line);
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (line + 16));
+            __m128i x0 = _mm_xor_si128(lo, v0);
+            __m128i x1 = _mm_xor_si128(hi, v1);
+            x0 = _mm_or_si128(_mm_slli_epi32(x0, 7), _mm_srli_epi32(x0, 25));
+            x1 = _mm_or_si128(_mm_slli_epi32(x1, 7), _mm_srli_epi32(x1, 25));
+            lo = _mm_add_epi32(x0, v0);
+            hi = _mm_add_epi32(x1, v1);
+        }
+        _mm_storeu_si128((__m128i *) lanes, lo);
+        _mm_storeu_si128((__m128i *) (lanes + 4), hi);
+    }
+}
+
+__attribute__((target("avx2")))
+void hash_line_avx2(const uint8_t *line, unsigned areas, unsigned area_blocks,
+                    uint32_t *lanes)
+{
+    for (unsigned a = 0; a < areas; ++a, lanes += 8) {
+        __m256i h = _mm256_loadu_si256((const __m256i *) lanes);
+        for (unsigned b = 0; b < area_blocks; ++b, line += block_pixels * 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) line);
+            __m256i x = _mm256_xor_si256(h, v);
+            x = _mm256_or_si256(_mm256_slli_epi32(x, 7), _mm256_srli_epi32(x, 25));
+            h = _mm256_add_epi32(x, v);
+        }
+        _mm256_storeu_si256((__m256i *) lanes, h);
+    }
+}
+#endif
+
+HashLineFunc *kernel_function(SimdLevel kernel)
+{
+    switch (kernel) {
+#if TILE_HASH_X86
+    case SimdLevel::AVX2:
+        return hash_line_avx2;
+    case SimdLevel::SSE2:
+        return hash_line_sse2;
+#endif
+    default:
+        return hash_line_scalar;
+    }
+}
+
+void init_lanes(uint32_t *lanes)
+{
+    for (unsigned i = 0; i < 8; ++i) {
+        lanes[i] = 0x9e3779b9u * (i + 1);
+    }
+}
+
+// mix the pixels of a line that do not fill a whole block
+void hash_line_rest(const uint8_t *line, unsigned pixels, uint32_t *lanes)
+{
+    for (unsigned i = 0; i < pixels; ++i) {
+        uint32_t pixel;
+        memcpy(&pixel, line + i * 4, 4);
+        lanes[i] = mix_pixel(lanes[i], pixel);
+    }
+}
+
+uint64_t finalize(const uint32_t *lanes, unsigned width, unsigned height)
+{
+    // fold the lanes and finalize (murmur3 64 bit finalizer)
+    uint64_t hash = ((uint64_t) width << 32) | height;
+    for (unsigned i = 0; i < 8; ++i) {
+        hash = (hash ^ lanes[i]) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+} // namespace
+
+SimdLevel TileChangeDetector::supported_kernel(SimdLevel kernel)
+{
+    return select_simd_level(kernel, {SimdLevel::SSE2, SimdLevel::AVX2});
+}
+
+uint64_t TileChangeDetector::hash_area(const uint8_t *data, unsigned width, unsigned height,
+                                       size_t stride, SimdLevel kernel)
+{
+    HashLineFunc *hash_line = kernel_function(supported_kernel(kernel));
+    const unsigned blocks = width / block_pixels;
+    const unsigned rest = width % block_pixels;
+
+    uint32_t lanes[8];
+    init_lanes(lanes);
+    for (unsigned y = 0; y < height; ++y, data += stride) {
+        hash_line(data, 1, blocks, lanes);
+        hash_line_rest(data + blocks * block_pixels * 4, rest, lanes);
+    }
+    return finalize(lanes, width, height);
+}
+
+TileChangeDetector::TileChangeDetector(unsigned tile_size, SimdLevel kernel) :
+    size(tile_size),
+    kernel_used(supported_kernel(kernel))
+{
+    if (tile_size == 0 || tile_size % block_pixels != 0) {
+        throw Error("Invalid tile size " + std::to_string(tile_size) +
+                    ", it must be a multiple of " + std::to_string(block_pixels));
+    }
+}
+
+void TileChangeDetector::reset()
+{
+    width = height = 0;
+    cols = tile_rows = 0;
+    hashes.clear();
+    changed.clear();
+}
+
+size_t TileChangeDetector::update(const uint8_t *data, unsigned width, unsigned height,
+                                  size_t stride)
+{
+    const bool new_geometry = width != this->width || height != this->height;
+    if (new_geometry) {
+        this->width = width;
+        this->height = height;
+        cols = (width + size - 1) / size;
+        tile_rows = (height + size - 1) / size;
+        hashes.assign(cols * tile_rows, 0);
+        changed.assign(cols * tile_rows, 1);
+    }
+
+    HashLineFunc *hash_line = kernel_function(kernel_used);
+    // the tiles of the last column can be narrower than the others
+    const unsigned full_cols = width / size;
+    const unsigned last_width = width % size;
+    const unsigned last_blocks = last_width / block_pixels;
+    const unsigned last_rest = last_width % block_pixels;
+
+    std::vector<uint32_t> lanes(cols * 8);
+    size_t count = 0;
+    for (unsigned row = 0; row < tile_rows; ++row) {
+        const unsigned y = row * size;
+        const unsigned h = std::min(size, height - y);
+
+        for (unsigned col = 0; col < cols; ++col) {
+            init_lanes(&lanes[col * 8]);
+        }
+        const uint8_t *line = data + y * stride;
+        for (unsigned i = 0; i < h; ++i, line += stride) {
+            hash_line(line, full_cols, size / block_pixels, lanes.data());
+            if (last_width) {
+                const uint8_t *last = line + full_cols * size * 4;
+                hash_line(last, 1, last_blocks, &lanes[full_cols * 8]);
+                hash_line_rest(last + last_blocks * block_pixels * 4, last_rest,
+                               &lanes[full_cols * 8]);
+            }
+        }
+
+        for (unsigned col = 0; col < cols; ++col) {
+            const size_t index = row * cols + col;
+            const unsigned w = std::min(size, width - col * size);
+            uint64_t hash = finalize(&lanes[col * 8], w, h);
+            changed[index] = new_geometry || hash != hashes[index];
+            hashes[index] = hash;
+            count += changed[index];
+        }
+    }
+
+    return count;
+}
+
+std::vector<DamageRect> TileChangeDetector::changed_rects() const
+{
+    std::vector<DamageRect> rects;
+
+    for (unsigned row = 0; row < tile_rows; ++row) {
+        const unsigned y = row * size;
+        const unsigned h = std::min(size, height - y);
+        unsigned col = 0;
+        while (col < cols) {
+            if (!tile_changed(col, row)) {
+                ++col;
+                continue;
+            }
+            const unsigned first = col;
+            while (col < cols && tile_changed(col, row)) {
+                ++col;
+            }
+            const unsigned x = first * size;
+            rects.push_back({(int) x, (int) y, std::min(col * size, width) - x, h});
+        }
+    }
+
+    return rects;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,50 @@
+/*
+ * Helpers for the unit tests of the frame processing kernels
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_SIMD_TEST_HPP
+#define SPICE_SIMD_TEST_HPP
+
+#include "spice-catch.hpp"
+
+#include <spice-streaming-agent/simd.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/*
+ * A frame of random bytes, the same for each call, including the padding
+ * at the end of the lines.
+ */
+inline std::vector<uint8_t> random_frame(size_t stride, unsigned height)
+{
+    std::mt19937 generator(42);
+    std::vector<uint8_t> frame(stride * height);
+    for (auto &byte : frame) {
+        byte = generator();
+    }
+    return frame;
+}
+
+/*
+ * Checks that run(level) gives the same result at every SIMD level as with
+ * the scalar kernel. The levels a module has no kernel for fall back to a
+ * lower one, the CPU may not support the others: the test passes anyway.
+ */
+template <typename Function>
+void check_simd_levels(Function run)
+{
+    using spice::streaming_agent::SimdLevel;
+
+    const auto expected = run(SimdLevel::Scalar);
+    for (auto level : {SimdLevel::SSE2, SimdLevel::SSSE3, SimdLevel::AVX2}) {
+        CHECK(run(level) == expected);
+    }
+}
+
+#endif // SPICE_SIMD_TEST_HPP
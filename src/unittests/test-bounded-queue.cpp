@@ -0,0 +1,91 @@
+/* The unit test for the bounded queue between pipeline stages.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "bounded-queue.hpp"
+
+#include <thread>
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test the drop-oldest policy", "[queue]") {
+    GIVEN("A full queue of 2 items dropping the oldest") {
+        ssa::BoundedQueue<int> queue(2, ssa::OverflowPolicy::DropOldest);
+        CHECK(queue.push(1));
+        CHECK(queue.push(2));
+
+        WHEN("pushing a third item") {
+            CHECK(queue.push(3));
+
+            THEN("the oldest item is dropped") {
+                int item;
+                REQUIRE(queue.try_pop(item));
+                CHECK(item == 2);
+                REQUIRE(queue.try_pop(item));
+                CHECK(item == 3);
+                CHECK_FALSE(queue.try_pop(item));
+            }
+
+            THEN("the counters account for it") {
+                ssa::QueueStats stats = queue.stats();
+                CHECK(stats.pushed == 3);
+                CHECK(stats.dropped == 1);
+                CHECK(stats.occupancy == 2);
+                CHECK(stats.max_occupancy == 2);
+            }
+        }
+    }
+}
+
+SCENARIO("test the blocking policy", "[queue]") {
+    GIVEN("A full queue of 1 item blocking the producer") {
+        ssa::BoundedQueue<int> queue(1, ssa::OverflowPolicy::Block);
+        CHECK(queue.push(1));
+
+        WHEN("a producer pushes another item") {
+            std::thread producer([&queue] { queue.push(2); });
+
+            THEN("it waits for the consumer and nothing is dropped") {
+                int item;
+                REQUIRE(queue.pop(item));
+                CHECK(item == 1);
+                REQUIRE(queue.pop(item));
+                CHECK(item == 2);
+                producer.join();
+                CHECK(queue.stats().dropped == 0);
+            }
+        }
+
+        WHEN("the queue is closed while a producer waits") {
+            bool pushed = true;
+            std::thread producer([&queue, &pushed] { pushed = queue.push(2); });
+            queue.close();
+            producer.join();
+
+            THEN("the producer gives up and the queued items can still be read") {
+                CHECK_FALSE(pushed);
+                int item;
+                REQUIRE(queue.pop(item));
+                CHECK(item == 1);
+                CHECK_FALSE(queue.pop(item));
+            }
+        }
+    }
+}
+
+SCENARIO("test waiting for an item with a timeout", "[queue]") {
+    GIVEN("An empty queue") {
+        ssa::BoundedQueue<int> queue(4, ssa::OverflowPolicy::DropOldest);
+
+        THEN("pop_for gives up") {
+            int item;
+            CHECK_FALSE(queue.pop_for(item, std::chrono::milliseconds(10)));
+        }
+    }
+}
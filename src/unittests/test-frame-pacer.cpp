@@ -0,0 +1,122 @@
+/* The unit test for the frame pacer.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include <spice-streaming-agent/frame-pacer.hpp>
+
+#include <algorithm>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+// the time only moves when the pacer sleeps or the test advances it
+class FakeClock final : public ssa::FramePacerClock
+{
+public:
+    uint64_t now_ns() override { return now; }
+    void sleep_until(uint64_t deadline_ns) override
+    {
+        now = std::max(now, deadline_ns) + wake_up_delay_ns;
+    }
+
+    uint64_t now = 1000000000u;
+    // added to each sleep, as a loaded scheduler does
+    uint64_t wake_up_delay_ns = 0;
+};
+
+}
+
+SCENARIO("test pacing frames", "[pacer]") {
+    GIVEN("A pacer at 100 frames per second") {
+        FakeClock clock;
+        ssa::FramePacer pacer(100, &clock);
+
+        WHEN("waiting for several frames") {
+            const uint64_t first = pacer.wait();
+            uint64_t deadline = first;
+            for (unsigned i = 0; i < 5; ++i) {
+                deadline = pacer.wait();
+            }
+
+            THEN("the deadlines are one period apart and none is missed") {
+                CHECK(first == 1000000000u);
+                CHECK(deadline - first == 50000000u);
+                CHECK(clock.now == deadline);
+                CHECK(pacer.stats().frames == 5);
+                CHECK(pacer.stats().missed == 0);
+                CHECK(pacer.stats().skipped == 0);
+            }
+        }
+
+        WHEN("the wake ups are late by less than a period") {
+            clock.wake_up_delay_ns = 3000000u;
+            const uint64_t first = pacer.wait();
+            uint64_t deadline = first;
+            for (unsigned i = 0; i < 5; ++i) {
+                deadline = pacer.wait();
+            }
+
+            THEN("the rate does not drift") {
+                CHECK(deadline - first == 50000000u);
+                CHECK(pacer.stats().skipped == 0);
+                CHECK(pacer.stats().max_jitter_ns == 3000000u);
+                CHECK(pacer.stats().total_jitter_ns == 5 * 3000000u);
+            }
+        }
+
+        WHEN("the caller falls behind by several periods") {
+            const uint64_t first = pacer.wait();
+            clock.now += 35000000u;
+            const uint64_t late = pacer.wait();
+            const uint64_t next = pacer.wait();
+
+            THEN("the late frame is produced and the schedule skips ahead") {
+                CHECK(pacer.stats().missed == 1);
+                CHECK(pacer.stats().skipped == 2);
+                CHECK(late - first == 30000000u);
+                CHECK(next - late == 10000000u);
+                CHECK(pacer.stats().max_jitter_ns == 25000000u);
+            }
+        }
+
+        WHEN("the caller blocked elsewhere and resyncs") {
+            pacer.wait();
+            clock.now += 25000000u;
+            pacer.resync();
+            const uint64_t start = clock.now;
+            const uint64_t deadline = pacer.wait();
+
+            THEN("no deadline is reported as missed") {
+                CHECK(deadline - start == 10000000u);
+                CHECK(pacer.stats().missed == 0);
+                CHECK(pacer.stats().skipped == 0);
+            }
+        }
+    }
+
+    GIVEN("A pacer on CLOCK_MONOTONIC") {
+        ssa::FramePacer pacer(100);
+
+        WHEN("waiting for several frames") {
+            const uint64_t first = pacer.wait();
+            uint64_t deadline = first;
+            for (unsigned i = 0; i < 3; ++i) {
+                deadline = pacer.wait();
+            }
+
+            THEN("it sleeps until the deadlines, which stay on the period grid") {
+                CHECK(ssa::FramePacer::now_ns() >= deadline);
+                // a loaded machine may skip periods, never break the grid
+                CHECK(pacer.stats().frames == 3);
+                CHECK(deadline - first == (3 + pacer.stats().skipped) * 10000000u);
+            }
+        }
+    }
+}
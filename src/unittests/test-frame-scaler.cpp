@@ -0,0 +1,74 @@
+/* The unit test for the frame downscaling.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+#include "simd-test.hpp"
+
+#include "frame-scaler.hpp"
+
+#include <vector>
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test the downscaling kernels", "[scaler]") {
+    GIVEN("A frame whose size is not a multiple of the factor") {
+        const unsigned width = 75, height = 31;
+        const size_t stride = width * 4 + 8;
+        auto frame = random_frame(stride, height);
+
+        THEN("the SIMD kernels average the 2x2 blocks as the scalar one") {
+            check_simd_levels([&](ssa::SimdLevel level) {
+                std::vector<uint8_t> output(37 * 15 * 4);
+                ssa::downscale_frame(frame.data(), stride, width, height, 2, output.data(),
+                                     level);
+                return output;
+            });
+        }
+    }
+}
+
+SCENARIO("test downscaling a frame", "[scaler]") {
+    GIVEN("A 6x3 frame") {
+        const std::vector<uint8_t> frame = {
+            0, 0, 0, 0,   3, 3, 3, 3,   9, 9, 9, 9,   255, 0, 0, 0,   0, 0, 0, 0,   1, 1, 1, 1,
+            0, 0, 0, 0,   3, 3, 3, 3,   9, 9, 9, 9,   255, 0, 0, 0,   0, 0, 0, 0,   1, 1, 1, 1,
+            0, 0, 0, 0,   3, 3, 3, 3,   9, 9, 9, 9,   255, 0, 0, 0,   0, 0, 0, 0,   1, 1, 1, 1,
+        };
+
+        WHEN("downscaling it by 3") {
+            std::vector<uint8_t> output(2 * 4);
+            ssa::downscale_frame(frame.data(), 6 * 4, 6, 3, 3, output.data());
+
+            THEN("each channel is the rounded average of a block") {
+                CHECK(output == std::vector<uint8_t>({ 4, 4, 4, 4, 85, 0, 0, 0 }));
+            }
+        }
+
+        WHEN("downscaling it by 2") {
+            std::vector<uint8_t> output(3 * 4);
+            ssa::downscale_frame(frame.data(), 6 * 4, 6, 3, 2, output.data());
+
+            THEN("the last line is dropped") {
+                CHECK(output == std::vector<uint8_t>({ 2, 2, 2, 2, 132, 5, 5, 5, 1, 1, 1, 1 }));
+            }
+        }
+    }
+}
+
+SCENARIO("test choosing the downscale factor", "[scaler]") {
+    THEN("the factor fits the frame in the maximum size") {
+        CHECK(ssa::downscale_factor(3840, 2160, 1, 1920, 1080) == 2);
+        CHECK(ssa::downscale_factor(3840, 2160, 1, 1280, 0) == 3);
+        CHECK(ssa::downscale_factor(1920, 1080, 1, 1920, 1080) == 1);
+    }
+
+    THEN("a fixed factor is a minimum") {
+        CHECK(ssa::downscale_factor(1920, 1080, 2, 0, 0) == 2);
+        CHECK(ssa::downscale_factor(3840, 2160, 2, 1000, 0) == 4);
+    }
+}
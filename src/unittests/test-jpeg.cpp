@@ -0,0 +1,241 @@
+/* The unit test for the JPEG encoder.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "jpeg.hpp"
+
+#include <algorithm>
+
+
+static std::vector<uint8_t> make_frame(unsigned width, unsigned height, unsigned seed)
+{
+    std::vector<uint8_t> frame(width * height * 4);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = (i * 31 + seed * 17 + (i / (width * 4)) * 7) & 0xff;
+    }
+    return frame;
+}
+
+// decodes a JPEG image to RGB, a corrupted image fails the test
+static std::vector<uint8_t> jpeg_decode(const std::vector<uint8_t> &jpeg,
+                                        unsigned &width, unsigned &height)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<uint8_t *>(jpeg.data()), jpeg.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    std::vector<uint8_t> pixels(width * height * cinfo.output_components);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &pixels[cinfo.output_scanline * width * cinfo.output_components];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    CHECK(jerr.num_warnings == 0);
+    jpeg_destroy_decompress(&cinfo);
+    return pixels;
+}
+
+// reads the size from the header of a JPEG image
+static std::pair<unsigned, unsigned> jpeg_size(const std::vector<uint8_t> &jpeg)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<uint8_t *>(jpeg.data()), jpeg.size());
+    jpeg_read_header(&cinfo, TRUE);
+    std::pair<unsigned, unsigned> size(cinfo.image_width, cinfo.image_height);
+    jpeg_destroy_decompress(&cinfo);
+    return size;
+}
+
+SCENARIO("test reusing the JPEG encoder", "[jpeg]") {
+    GIVEN("A JPEG encoder") {
+        JpegEncoder encoder;
+        std::vector<uint8_t> frame = make_frame(64, 48, 1);
+        std::vector<uint8_t> output;
+
+        WHEN("encoding several frames") {
+            std::vector<uint8_t> other = make_frame(64, 48, 2);
+            encoder.encode(output, 80, frame.data(), 64, 48);
+            encoder.encode(output, 80, other.data(), 64, 48);
+            encoder.encode(output, 80, frame.data(), 64, 48);
+
+            THEN("each frame is encoded as by a new encoder") {
+                std::vector<uint8_t> expected;
+                write_JPEG_file(expected, 80, frame.data(), 64, 48);
+                CHECK(output == expected);
+            }
+        }
+
+        WHEN("the size and the quality change") {
+            std::vector<uint8_t> big = make_frame(96, 64, 3);
+            encoder.encode(output, 80, frame.data(), 64, 48);
+            encoder.encode(output, 50, big.data(), 96, 64);
+
+            THEN("the encoder is reconfigured") {
+                std::vector<uint8_t> expected;
+                write_JPEG_file(expected, 50, big.data(), 96, 64);
+                CHECK(output == expected);
+                CHECK(jpeg_size(output) == std::make_pair(96u, 64u));
+            }
+        }
+
+        WHEN("the lines of the frame are padded") {
+            const size_t stride = 64 * 4 + 32;
+            std::vector<uint8_t> padded(stride * 48, 0xaa);
+            for (unsigned y = 0; y < 48; ++y) {
+                std::copy_n(&frame[y * 64 * 4], 64 * 4, &padded[y * stride]);
+            }
+            encoder.encode(output, 80, padded.data(), 64, 48, stride);
+
+            THEN("the padding is skipped") {
+                std::vector<uint8_t> expected;
+                write_JPEG_file(expected, 80, frame.data(), 64, 48);
+                CHECK(output == expected);
+            }
+        }
+
+        WHEN("the frame is in a 16 bits format") {
+            const spice::streaming_agent::PixelFormat rgb565 = { 16, 16, false, 0xf800, 0x07e0, 0x001f };
+            std::vector<uint8_t> frame16(64 * 48 * 2), same(64 * 48 * 4);
+            for (size_t i = 0; i < 64 * 48; ++i) {
+                // pixels whose channels are exact in both formats
+                const unsigned r = (i * 7) & 0x1f, g = (i * 3) & 0x3f, b = i & 0x1f;
+                const unsigned pixel = (r << 11) | (g << 5) | b;
+                frame16[i * 2] = pixel & 0xff;
+                frame16[i * 2 + 1] = pixel >> 8;
+                same[i * 4] = (b << 3) | (b >> 2);
+                same[i * 4 + 1] = (g << 2) | (g >> 4);
+                same[i * 4 + 2] = (r << 3) | (r >> 2);
+            }
+            encoder.encode(output, 80, frame.data(), 64, 48);
+            encoder.set_pixel_format(rgb565);
+            encoder.encode(output, 80, frame16.data(), 64, 48);
+
+            THEN("it is encoded as the same BGRX frame") {
+                std::vector<uint8_t> expected;
+                write_JPEG_file(expected, 80, same.data(), 64, 48);
+                CHECK(output == expected);
+            }
+        }
+
+        WHEN("the output does not fit in the initial buffer") {
+            std::vector<uint8_t> big = make_frame(512, 512, 4);
+            encoder.encode(output, 95, big.data(), 512, 512);
+
+            THEN("the buffer grows") {
+                CHECK(output.size() > 32 * 1024);
+                CHECK(jpeg_size(output) == std::make_pair(512u, 512u));
+            }
+        }
+
+        WHEN("encoding into small blocks") {
+            auto pool = std::make_shared<spice::streaming_agent::BlockPool>(4096);
+            spice::streaming_agent::SegmentedBuffer segments(pool);
+            std::vector<uint8_t> big = make_frame(512, 512, 4);
+            encoder.encode(segments, 95, big.data(), 512, 512);
+            encoder.encode(segments, 95, big.data(), 512, 512);
+
+            THEN("the blocks hold the same image as a contiguous buffer") {
+                encoder.encode(output, 95, big.data(), 512, 512);
+                CHECK(segments.iovecs().size() > 1);
+                CHECK(segments.to_vector() == output);
+            }
+            THEN("the blocks of the previous frame are recycled") {
+                CHECK(pool->allocated() == segments.iovecs().size());
+            }
+        }
+    }
+}
+
+SCENARIO("test the parallel JPEG encoder", "[jpeg]") {
+    // sizes that are not multiple of the MCU size, with a partial last stripe
+    const std::pair<unsigned, unsigned> sizes[] = { {200, 150}, {64, 64}, {1000, 37} };
+
+    for (const auto &size : sizes) {
+        GIVEN("A " + std::to_string(size.first) + "x" + std::to_string(size.second) + " frame") {
+            std::vector<uint8_t> frame = make_frame(size.first, size.second, 5);
+            std::vector<uint8_t> reference;
+            write_JPEG_file(reference, 80, frame.data(), size.first, size.second);
+
+            for (unsigned threads : {1u, 2u, 3u, 4u}) {
+                WHEN("encoding it with " + std::to_string(threads) + " threads") {
+                    ParallelJpegEncoder encoder(threads);
+                    std::vector<uint8_t> output;
+                    encoder.encode(output, 80, frame.data(), size.first, size.second);
+                    // a second frame through the same workers
+                    encoder.encode(output, 80, frame.data(), size.first, size.second);
+                    spice::streaming_agent::SegmentedBuffer segments(
+                        std::make_shared<spice::streaming_agent::BlockPool>(1024));
+                    encoder.encode(segments, 80, frame.data(), size.first, size.second);
+
+                    THEN("it decodes exactly as the single-threaded image") {
+                        unsigned ref_width, ref_height, width, height;
+                        std::vector<uint8_t> expected = jpeg_decode(reference, ref_width, ref_height);
+                        std::vector<uint8_t> decoded = jpeg_decode(output, width, height);
+                        CHECK(width == size.first);
+                        CHECK(height == size.second);
+                        CHECK(decoded == expected);
+                        CHECK(segments.to_vector() == output);
+                    }
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("test the stripe cache of the parallel JPEG encoder", "[jpeg]") {
+    GIVEN("An encoder caching stripes of 16 lines") {
+        const unsigned width = 120, height = 100;
+        std::vector<uint8_t> frame = make_frame(width, height, 6);
+        ParallelJpegEncoder encoder(1);
+        encoder.set_stripe_cache(16);
+        std::vector<uint8_t> output;
+        encoder.encode(output, 80, frame.data(), width, height);
+
+        WHEN("a few lines change") {
+            for (unsigned x = 0; x < width * 4; ++x) {
+                frame[40 * width * 4 + x] ^= 0x55;
+            }
+            encoder.encode(output, 80, frame.data(), width, height);
+
+            THEN("only their stripe is encoded again") {
+                CHECK(encoder.stripe_cache_stats().encoded == 7 + 1);
+                CHECK(encoder.stripe_cache_stats().reused == 6);
+            }
+            THEN("the image decodes as if all the stripes were encoded") {
+                ParallelJpegEncoder uncached(1);
+                uncached.set_stripe_cache(16);
+                std::vector<uint8_t> expected;
+                uncached.encode(expected, 80, frame.data(), width, height);
+                CHECK(output == expected);
+
+                unsigned decoded_width, decoded_height;
+                jpeg_decode(output, decoded_width, decoded_height);
+                CHECK(decoded_width == width);
+                CHECK(decoded_height == height);
+            }
+        }
+
+        WHEN("the quality changes") {
+            encoder.encode(output, 60, frame.data(), width, height);
+
+            THEN("all the stripes are encoded again") {
+                CHECK(encoder.stripe_cache_stats().encoded == 7 + 7);
+                CHECK(encoder.stripe_cache_stats().reused == 0);
+            }
+        }
+    }
+}
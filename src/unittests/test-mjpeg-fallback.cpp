@@ -14,6 +14,14 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             std::vector<ssa::ConfigureOption> options = {
                 {"framerate", "20"},
                 {"mjpeg.quality", "90"},
+                {"change-detection", "off"},
+                {"mjpeg.threads", "4"},
+                {"mjpeg.bitrate", "4000000"},
+                {"mjpeg.min-quality", "30"},
+                {"mjpeg.max-quality", "85"},
+                {"mjpeg.downscale", "2"},
+                {"mjpeg.max-size", "1920x1080"},
+                {"mjpeg.stripe-cache", "64"},
                 {NULL, NULL}
             };
 
@@ -23,6 +31,16 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             THEN("the options are set in the plugin") {
                 CHECK(new_options.fps == 20);
                 CHECK(new_options.quality == 90);
+                CHECK(new_options.change_detection == ssa::ChangeDetection::Off);
+                CHECK(new_options.threads == 4);
+                CHECK(new_options.bitrate == 4000000);
+                CHECK(new_options.frame_budget == 0);
+                CHECK(new_options.min_quality == 30);
+                CHECK(new_options.max_quality == 85);
+                CHECK(new_options.downscale == 2);
+                CHECK(new_options.max_width == 1920);
+                CHECK(new_options.max_height == 1080);
+                CHECK(new_options.stripe_cache == 64);
             }
         }
 
@@ -53,5 +71,48 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
                 );
             }
         }
+
+        WHEN("passing a quality bound out of range") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"mjpeg.max-quality", "101"},
+                {NULL, NULL}
+            };
+
+            THEN("ParseOptions throws an exception") {
+                REQUIRE_THROWS_WITH(
+                    plugin.ParseOptions(options.data()),
+                    "Invalid value '101' for option 'mjpeg.max-quality'."
+                );
+            }
+        }
+
+        WHEN("passing a malformed maximum size") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"mjpeg.max-size", "1920x"},
+                {NULL, NULL}
+            };
+
+            THEN("ParseOptions throws an exception") {
+                REQUIRE_THROWS_WITH(
+                    plugin.ParseOptions(options.data()),
+                    "Invalid value '1920x' for option 'mjpeg.max-size'."
+                );
+            }
+        }
+
+        WHEN("passing a negative or zero maximum size") {
+            THEN("ParseOptions throws an exception") {
+                for (const char *size : {"-1x-1", "1920x-1", "0x1080", "1920x0"}) {
+                    std::vector<ssa::ConfigureOption> options = {
+                        {"mjpeg.max-size", size},
+                        {NULL, NULL}
+                    };
+                    REQUIRE_THROWS_WITH(
+                        plugin.ParseOptions(options.data()),
+                        std::string("Invalid value '") + size + "' for option 'mjpeg.max-size'."
+                    );
+                }
+            }
+        }
     }
 }
@@ -0,0 +1,116 @@
+/* The unit test for the pixel format conversion.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+#include "simd-test.hpp"
+
+#include <spice-streaming-agent/pixel-format.hpp>
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+std::vector<uint8_t> convert(const ssa::PixelFormat &format, ssa::SimdLevel kernel,
+                             const std::vector<uint8_t> &frame, size_t stride,
+                             unsigned width, unsigned height)
+{
+    ssa::PixelConverter converter(format, kernel);
+    std::vector<uint8_t> rgb(width * height * 3);
+    converter.convert(frame.data(), stride, rgb.data(), width, height);
+    return rgb;
+}
+
+const ssa::PixelFormat rgb565 = { 16, 16, false, 0xf800, 0x07e0, 0x001f };
+const ssa::PixelFormat bgr24 = { 24, 24, false, 0xff0000, 0xff00, 0xff };
+
+}
+
+SCENARIO("test the conversion kernels", "[pixel-format]") {
+    const std::pair<ssa::PixelFormat, const char *> formats[] = {
+        { ssa::PixelFormat::bgrx(), "BGRX" },
+        { rgb565, "RGB565" },
+        { bgr24, "24 bits" },
+    };
+
+    for (const auto &format : formats) {
+        // widths around the block sizes of the kernels
+        for (unsigned width : {1u, 7u, 16u, 37u, 133u}) {
+            GIVEN("A " + std::to_string(width) + " pixels wide " + format.second + " frame") {
+                const unsigned height = 5;
+                const size_t stride = width * format.first.bits_per_pixel / 8 + 12;
+                auto frame = random_frame(stride, height);
+
+                THEN("all the kernels produce the same pixels as the generic conversion") {
+                    // the same pixels stored in the other byte order only
+                    // have the generic conversion
+                    ssa::PixelFormat swapped_format = format.first;
+                    swapped_format.big_endian = true;
+                    const unsigned bytes = format.first.bits_per_pixel / 8;
+                    auto swapped = frame;
+                    for (unsigned y = 0; y < height; ++y) {
+                        for (unsigned x = 0; x < width; ++x) {
+                            auto pixel = swapped.begin() + y * stride + x * bytes;
+                            std::reverse(pixel, pixel + bytes);
+                        }
+                    }
+                    auto expected = convert(swapped_format, ssa::SimdLevel::Scalar,
+                                            swapped, stride, width, height);
+
+                    CHECK(convert(format.first, ssa::SimdLevel::Scalar,
+                                  frame, stride, width, height) == expected);
+                    check_simd_levels([&](ssa::SimdLevel level) {
+                        return convert(format.first, level, frame, stride, width, height);
+                    });
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("test converting pixels", "[pixel-format]") {
+    GIVEN("BGRX pixels") {
+        const std::vector<uint8_t> frame = { 0x10, 0x20, 0x30, 0xff, 0xaa, 0xbb, 0xcc, 0x00 };
+
+        THEN("the channels are reordered and the padding dropped") {
+            CHECK(convert(ssa::PixelFormat::bgrx(), ssa::SimdLevel::Best, frame, 8, 2, 1) ==
+                  std::vector<uint8_t>({ 0x30, 0x20, 0x10, 0xcc, 0xbb, 0xaa }));
+        }
+    }
+
+    GIVEN("RGB565 pixels") {
+        // white, pure red and a dark green (green = 1)
+        const std::vector<uint8_t> frame = { 0xff, 0xff, 0x00, 0xf8, 0x20, 0x00 };
+
+        THEN("the channels are expanded to 8 bits") {
+            CHECK(convert(rgb565, ssa::SimdLevel::Scalar, frame, 6, 3, 1) ==
+                  std::vector<uint8_t>({ 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x04, 0x00 }));
+        }
+    }
+
+    GIVEN("Big endian XRGB pixels") {
+        const ssa::PixelFormat format = { 24, 32, true, 0xff0000, 0xff00, 0xff };
+        const std::vector<uint8_t> frame = { 0x00, 0x30, 0x20, 0x10 };
+
+        THEN("the byte order is honoured") {
+            CHECK_FALSE(format.is_bgrx());
+            CHECK(convert(format, ssa::SimdLevel::Best, frame, 4, 1, 1) ==
+                  std::vector<uint8_t>({ 0x30, 0x20, 0x10 }));
+        }
+    }
+
+    GIVEN("A pseudo color format") {
+        const ssa::PixelFormat format = { 8, 8, false, 0, 0, 0 };
+
+        THEN("it is rejected") {
+            CHECK_THROWS_AS(ssa::PixelConverter(format), ssa::Error);
+        }
+    }
+}
@@ -0,0 +1,96 @@
+/* The unit test for the adaptive JPEG quality.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "quality-controller.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+// a rough model of the JPEG size: it grows with the quality
+size_t frame_size(int quality, size_t scale)
+{
+    return scale * (quality + 10) / 10;
+}
+
+}
+
+SCENARIO("test adapting the quality to a frame budget", "[quality]") {
+    GIVEN("A controller with a budget of 100000 bytes per frame") {
+        ssa::QualityController controller(80, 10, 95, 100000);
+
+        WHEN("the frames are much bigger than the budget") {
+            bool changed = false;
+            for (unsigned i = 0; i < 50; ++i) {
+                changed |= controller.update(frame_size(controller.quality(), 30000));
+            }
+
+            THEN("the quality goes down until the frames fit") {
+                CHECK(changed);
+                CHECK(controller.quality() < 80);
+                CHECK(frame_size(controller.quality(), 30000) <= 120000);
+                CHECK(frame_size(controller.quality(), 30000) >= 70000);
+            }
+        }
+
+        WHEN("the frames are always too big") {
+            for (unsigned i = 0; i < 100; ++i) {
+                controller.update(1000000);
+            }
+
+            THEN("the quality stops at the lower bound") {
+                CHECK(controller.quality() == 10);
+            }
+        }
+
+        WHEN("the frames are tiny") {
+            for (unsigned i = 0; i < 100; ++i) {
+                controller.update(1000);
+            }
+
+            THEN("the quality stops at the upper bound") {
+                CHECK(controller.quality() == 95);
+            }
+        }
+
+        WHEN("the frames are slightly over or under the budget") {
+            for (unsigned i = 0; i < 50; ++i) {
+                controller.update(i % 2 ? 115000 : 80000);
+            }
+
+            THEN("the quality does not move") {
+                CHECK(controller.quality() == 80);
+            }
+        }
+
+        WHEN("a single frame is too big") {
+            controller.update(100000);
+            controller.update(100000);
+            controller.update(100000);
+            bool changed = controller.update(150000);
+
+            THEN("the moving average absorbs it") {
+                CHECK_FALSE(changed);
+                CHECK(controller.quality() == 80);
+            }
+        }
+    }
+
+    GIVEN("A controller without budget") {
+        ssa::QualityController controller(80, 10, 95, 0);
+
+        THEN("the quality is fixed") {
+            for (unsigned i = 0; i < 20; ++i) {
+                CHECK_FALSE(controller.update(1000000));
+            }
+            CHECK(controller.quality() == 80);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+/* The unit test for the segmented frame buffers.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "segmented-buffer.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+std::vector<uint8_t> make_data(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = i * 7 + 3;
+    }
+    return data;
+}
+
+}
+
+SCENARIO("test writing into a segmented buffer", "[segmented]") {
+    GIVEN("A buffer of 16 bytes blocks") {
+        auto pool = std::make_shared<ssa::BlockPool>(16, 4);
+        ssa::SegmentedBuffer buffer(pool);
+        const std::vector<uint8_t> data = make_data(40);
+
+        WHEN("appending data spanning several blocks") {
+            buffer.append(data.data(), 10);
+            buffer.append(data.data() + 10, 30);
+
+            THEN("the blocks are filled one after the other") {
+                CHECK(buffer.size() == 40);
+                auto iov = buffer.iovecs();
+                REQUIRE(iov.size() == 3);
+                CHECK(iov[0].iov_len == 16);
+                CHECK(iov[1].iov_len == 16);
+                CHECK(iov[2].iov_len == 8);
+                CHECK(buffer.to_vector() == data);
+            }
+        }
+
+        WHEN("writing whole blocks directly") {
+            memcpy(buffer.add_block(), data.data(), 16);
+            memcpy(buffer.add_block(), data.data() + 16, 16);
+            buffer.set_tail(5);
+
+            THEN("only the used part of the last block counts") {
+                CHECK(buffer.size() == 21);
+                CHECK(buffer.to_vector() == std::vector<uint8_t>(data.begin(), data.begin() + 21));
+            }
+        }
+
+        WHEN("the buffer is cleared and written again") {
+            buffer.append(data.data(), data.size());
+            buffer.clear();
+            CHECK(buffer.empty());
+            buffer.append(data.data(), data.size());
+
+            THEN("the blocks are recycled") {
+                CHECK(pool->allocated() == 3);
+                CHECK(buffer.to_vector() == data);
+            }
+        }
+
+        WHEN("the buffer is cloned and moved") {
+            buffer.append(data.data(), data.size());
+            ssa::SegmentedBuffer copy = buffer.clone();
+            ssa::SegmentedBuffer moved(std::move(buffer));
+
+            THEN("the copy has its own blocks") {
+                CHECK(pool->allocated() == 6);
+                CHECK(copy.to_vector() == data);
+                CHECK(moved.to_vector() == data);
+                CHECK(buffer.empty());
+            }
+        }
+
+        WHEN("referring to data owned elsewhere between appends") {
+            buffer.append(data.data(), 10);
+            buffer.append_reference(data.data() + 10, 20);
+            buffer.append(data.data() + 30, 10);
+
+            THEN("the reference is chained without being copied") {
+                CHECK(buffer.size() == 40);
+                auto iov = buffer.iovecs();
+                REQUIRE(iov.size() == 3);
+                CHECK(iov[1].iov_base == data.data() + 10);
+                CHECK(iov[1].iov_len == 20);
+                CHECK(pool->allocated() == 2);
+                CHECK(buffer.to_vector() == data);
+            }
+            THEN("a range of it can be referred to by another buffer") {
+                ssa::SegmentedBuffer range;
+                range.append_reference(buffer, 5, 30);
+                CHECK(range.iovecs().size() == 3);
+                CHECK(range.to_vector() == std::vector<uint8_t>(data.begin() + 5, data.begin() + 35));
+            }
+            THEN("a clone copies the reference into blocks") {
+                ssa::SegmentedBuffer copy = buffer.clone();
+                CHECK(copy.to_vector() == data);
+                for (const auto &piece : copy.iovecs()) {
+                    CHECK((piece.iov_base < data.data() || piece.iov_base >= data.data() + data.size()));
+                }
+            }
+        }
+    }
+
+    GIVEN("Buffers without a pool") {
+        auto pool = std::make_shared<ssa::BlockPool>(16, 4);
+        ssa::SegmentedBuffer buffer(pool);
+        ssa::SegmentedBuffer moved(std::move(buffer));
+        ssa::SegmentedBuffer empty;
+        const std::vector<uint8_t> data = make_data(8);
+
+        THEN("they are empty and reject writes") {
+            CHECK(empty.empty());
+            CHECK(buffer.empty());
+            REQUIRE_THROWS_AS(empty.append(data.data(), data.size()), std::logic_error);
+            REQUIRE_THROWS_AS(buffer.add_block(), std::logic_error);
+            REQUIRE_THROWS_AS(buffer.block_size(), std::logic_error);
+        }
+        THEN("they still take references") {
+            empty.append_reference(data.data(), data.size());
+            CHECK(empty.to_vector() == data);
+            empty.clear();
+            CHECK(empty.empty());
+        }
+    }
+
+    GIVEN("A pool keeping at most 2 free blocks") {
+        auto pool = std::make_shared<ssa::BlockPool>(16, 2);
+
+        WHEN("more blocks are released") {
+            {
+                ssa::SegmentedBuffer buffer(pool);
+                const std::vector<uint8_t> data = make_data(64);
+                buffer.append(data.data(), data.size());
+                CHECK(pool->allocated() == 4);
+            }
+
+            THEN("the extra blocks are freed") {
+                CHECK(pool->allocated() == 2);
+            }
+        }
+    }
+}
@@ -8,6 +8,8 @@
 #include "spice-catch.hpp"
 #include <sys/socket.h>
 #include <signal.h>
+#include <thread>
+#include <vector>
 
 #include "stream-port.hpp"
 #include <spice-streaming-agent/error.hpp>
@@ -56,6 +58,63 @@ SCENARIO("test basic IO on the stream port", "[port][io]") {
             CHECK(std::string(buf, src_size) == src_buf);
         }
 
+        WHEN("writing several buffers at once") {
+            ssa::MessageBuffers buffers;
+            buffers.append(src_buf, 3);
+            buffers.append_copy(src_buf + 3, 4);
+            std::vector<iovec> iov = buffers.iovecs();
+            ssa::writev_all(fd[1], iov.data(), iov.size());
+            char buf[10];
+            CHECK(read(fd[0], buf, src_size) == src_size);
+            CHECK(std::string(buf, src_size) == src_buf);
+        }
+
+        WHEN("writing more data than the port accepts at once") {
+            // the socket buffer is filled, writev has to be resumed in the
+            // middle of a buffer
+            std::vector<uint8_t> big(4 * 1024 * 1024);
+            for (size_t i = 0; i < big.size(); ++i) {
+                big[i] = i * 7;
+            }
+            uint32_t header = 0x12345678;
+            iovec iov[] = {
+                {&header, sizeof(header)},
+                {big.data(), big.size()},
+                {&header, sizeof(header)},
+            };
+
+            std::vector<uint8_t> received(big.size() + 2 * sizeof(header));
+            std::thread reader([&] { ssa::read_all(fd[0], received.data(), received.size()); });
+            ssa::writev_all(fd[1], iov, 3);
+            reader.join();
+
+            CHECK(memcmp(received.data(), &header, sizeof(header)) == 0);
+            CHECK(memcmp(received.data() + sizeof(header), big.data(), big.size()) == 0);
+            CHECK(memcmp(received.data() + sizeof(header) + big.size(), &header, sizeof(header)) == 0);
+        }
+
+        WHEN("writing without blocking more data than the port accepts") {
+            ssa::StreamPort port(dup(fd[1]));
+            std::vector<uint8_t> big(4 * 1024 * 1024, 0x5a);
+            ssa::MessageBuffers buffers;
+            buffers.append_copy(src_buf, src_size);
+            buffers.append(big.data(), big.size());
+
+            THEN("the rest of the message is written by flush") {
+                CHECK_FALSE(port.try_send(std::move(buffers)));
+                CHECK_FALSE(port.flush(false));
+
+                std::vector<uint8_t> received(src_size + big.size());
+                std::thread reader([&] { ssa::read_all(fd[0], received.data(), received.size()); });
+                CHECK(port.flush(true));
+                reader.join();
+
+                CHECK(memcmp(received.data(), src_buf, src_size) == 0);
+                CHECK(memcmp(received.data() + src_size, big.data(), big.size()) == 0);
+                CHECK(port.flush(false));
+            }
+        }
+
         WHEN("closing the remote end and trying to read") {
             CHECK(write(fd[0], src_buf, src_size) == src_size);
             char buf[10];
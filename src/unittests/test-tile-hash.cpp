@@ -0,0 +1,111 @@
+/* The unit test for the tile hash change detection.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+#include "simd-test.hpp"
+
+#include <spice-streaming-agent/tile-hash.hpp>
+#include <spice-streaming-agent/error.hpp>
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test the tile hash kernels", "[tile-hash]") {
+    GIVEN("A frame whose width is not a multiple of the block size") {
+        const unsigned width = 133, height = 71;
+        const size_t stride = width * 4 + 12;
+        auto frame = random_frame(stride, height);
+
+        THEN("all the kernels compute the same hash") {
+            check_simd_levels([&](ssa::SimdLevel level) {
+                return ssa::TileChangeDetector::hash_area(frame.data(), width, height, stride,
+                                                          level);
+            });
+        }
+
+        THEN("the padding at the end of the lines is not hashed") {
+            uint64_t before = ssa::TileChangeDetector::hash_area(frame.data(), width, height, stride);
+            frame[width * 4 + 3] ^= 0xff;
+            CHECK(ssa::TileChangeDetector::hash_area(frame.data(), width, height, stride) == before);
+        }
+    }
+}
+
+SCENARIO("test detecting changed tiles", "[tile-hash]") {
+    GIVEN("A detector and a frame") {
+        const unsigned width = 200, height = 100;
+        const size_t stride = width * 4;
+        auto frame = random_frame(stride, height);
+        ssa::TileChangeDetector detector(64);
+
+        WHEN("the first frame is hashed") {
+            THEN("all the tiles are reported changed") {
+                CHECK(detector.update(frame.data(), width, height, stride) == 8);
+                CHECK(detector.columns() == 4);
+                CHECK(detector.rows() == 2);
+            }
+        }
+
+        WHEN("the same frame is hashed again") {
+            detector.update(frame.data(), width, height, stride);
+            THEN("no tile is reported changed") {
+                CHECK(detector.update(frame.data(), width, height, stride) == 0);
+                CHECK(detector.changed_rects().empty());
+            }
+        }
+
+        WHEN("a single pixel changes") {
+            detector.update(frame.data(), width, height, stride);
+            frame[70 * stride + 130 * 4] ^= 1;
+            THEN("only the tile holding the pixel is reported") {
+                CHECK(detector.update(frame.data(), width, height, stride) == 1);
+                CHECK(detector.tile_changed(2, 1));
+                auto rects = detector.changed_rects();
+                REQUIRE(rects.size() == 1);
+                CHECK(rects[0].x == 128);
+                CHECK(rects[0].y == 64);
+                CHECK(rects[0].width == 64);
+                CHECK(rects[0].height == 36);
+            }
+        }
+
+        WHEN("adjacent tiles change") {
+            detector.update(frame.data(), width, height, stride);
+            frame[10 * stride + 150 * 4] ^= 1;
+            frame[10 * stride + 199 * 4] ^= 1;
+            THEN("they are merged in a single rectangle clipped to the frame") {
+                CHECK(detector.update(frame.data(), width, height, stride) == 2);
+                auto rects = detector.changed_rects();
+                REQUIRE(rects.size() == 1);
+                CHECK(rects[0].x == 128);
+                CHECK(rects[0].width == 72);
+                CHECK(rects[0].height == 64);
+            }
+        }
+
+        WHEN("the frame size changes") {
+            detector.update(frame.data(), width, height, stride);
+            THEN("all the tiles are reported changed") {
+                CHECK(detector.update(frame.data(), width - 8, height, stride) == 6);
+            }
+        }
+
+        WHEN("the detector is reset") {
+            detector.update(frame.data(), width, height, stride);
+            detector.reset();
+            THEN("all the tiles are reported changed") {
+                CHECK(detector.update(frame.data(), width, height, stride) == 8);
+            }
+        }
+    }
+
+    GIVEN("An invalid tile size") {
+        THEN("the detector cannot be created") {
+            CHECK_THROWS_AS(ssa::TileChangeDetector(12), ssa::Error);
+        }
+    }
+}
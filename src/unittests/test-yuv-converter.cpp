@@ -0,0 +1,213 @@
+/* The unit test for the BGRX to YUV conversion.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+#include "simd-test.hpp"
+
+#include <spice-streaming-agent/yuv-converter.hpp>
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+// the BT.601 limited range conversion in floating point
+std::vector<uint8_t> reference_i420(const std::vector<uint8_t> &frame, size_t stride,
+                                    unsigned width, unsigned height)
+{
+    const ssa::YuvLayout layout = ssa::YuvLayout::compute(ssa::YuvFormat::I420, width, height);
+    std::vector<uint8_t> yuv(layout.size);
+    for (unsigned y = 0; y < height; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+            const uint8_t *p = &frame[y * stride + x * 4];
+            yuv[y * layout.strides[0] + x] =
+                std::lround(16 + 0.256788 * p[2] + 0.504129 * p[1] + 0.097906 * p[0]);
+        }
+    }
+    for (unsigned y = 0; y < height / 2; ++y) {
+        for (unsigned x = 0; x < width / 2; ++x) {
+            double blue = 0, green = 0, red = 0;
+            for (unsigned i = 0; i < 4; ++i) {
+                const uint8_t *p = &frame[(y * 2 + i / 2) * stride + (x * 2 + i % 2) * 4];
+                blue += p[0] / 4.0;
+                green += p[1] / 4.0;
+                red += p[2] / 4.0;
+            }
+            yuv[layout.offsets[1] + y * layout.strides[1] + x] =
+                std::lround(128 - 0.148223 * red - 0.290993 * green + 0.439216 * blue);
+            yuv[layout.offsets[2] + y * layout.strides[2] + x] =
+                std::lround(128 + 0.439216 * red - 0.367788 * green - 0.071427 * blue);
+        }
+    }
+    return yuv;
+}
+
+// the largest difference between the samples of two I420 frames, the padding excluded
+int max_difference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b,
+                   unsigned width, unsigned height)
+{
+    const ssa::YuvLayout layout = ssa::YuvLayout::compute(ssa::YuvFormat::I420, width, height);
+    int difference = 0;
+    for (unsigned plane = 0; plane < 3; ++plane) {
+        const unsigned plane_width = plane ? width / 2 : width;
+        const unsigned plane_height = plane ? height / 2 : height;
+        for (unsigned y = 0; y < plane_height; ++y) {
+            for (unsigned x = 0; x < plane_width; ++x) {
+                const size_t pos = layout.offsets[plane] + y * layout.strides[plane] + x;
+                difference = std::max(difference, std::abs(a[pos] - b[pos]));
+            }
+        }
+    }
+    return difference;
+}
+
+std::vector<uint8_t> convert(ssa::YuvConverter &converter, const std::vector<uint8_t> &frame,
+                             size_t stride, unsigned width, unsigned height)
+{
+    const ssa::YuvLayout layout = ssa::YuvLayout::compute(converter.format(), width, height);
+    std::vector<uint8_t> yuv(layout.size);
+    converter.convert(frame.data(), stride, width, height, yuv.data());
+    return yuv;
+}
+
+}
+
+SCENARIO("test the YUV conversion kernels", "[yuv-converter]") {
+    // a width that is not a multiple of the kernel blocks
+    const unsigned width = 138, height = 42;
+    const size_t stride = width * 4 + 12;
+    const auto frame = random_frame(stride, height);
+
+    const ssa::SimdLevel kernels[] = {
+        ssa::SimdLevel::Scalar, ssa::SimdLevel::SSE2, ssa::SimdLevel::AVX2
+    };
+
+    GIVEN("The reference conversion") {
+        const auto reference = reference_i420(frame, stride, width, height);
+
+        THEN("each kernel is within one level of the reference") {
+            for (auto kernel : kernels) {
+                ssa::YuvConverter converter(ssa::YuvFormat::I420, 1, kernel);
+                CHECK(max_difference(convert(converter, frame, stride, width, height),
+                                     reference, width, height) <= 1);
+            }
+        }
+    }
+
+    GIVEN("The scalar conversion") {
+        ssa::YuvConverter scalar(ssa::YuvFormat::I420, 1, ssa::SimdLevel::Scalar);
+        const auto expected = convert(scalar, frame, stride, width, height);
+
+        THEN("all the kernels give the same samples") {
+            check_simd_levels([&](ssa::SimdLevel level) {
+                ssa::YuvConverter converter(ssa::YuvFormat::I420, 1, level);
+                return max_difference(convert(converter, frame, stride, width, height),
+                                      expected, width, height);
+            });
+        }
+
+        THEN("NV12 has the same samples, the chroma interleaved") {
+            const ssa::YuvLayout i420 =
+                ssa::YuvLayout::compute(ssa::YuvFormat::I420, width, height);
+            const ssa::YuvLayout nv12 =
+                ssa::YuvLayout::compute(ssa::YuvFormat::NV12, width, height);
+            for (auto kernel : kernels) {
+                ssa::YuvConverter converter(ssa::YuvFormat::NV12, 1, kernel);
+                const auto yuv = convert(converter, frame, stride, width, height);
+                bool same = true;
+                for (unsigned y = 0; y < height; ++y) {
+                    same &= std::equal(&yuv[y * nv12.strides[0]], &yuv[y * nv12.strides[0] + width],
+                                       &expected[y * i420.strides[0]]);
+                }
+                for (unsigned y = 0; y < height / 2; ++y) {
+                    for (unsigned x = 0; x < width / 2; ++x) {
+                        const uint8_t *uv = &yuv[nv12.offsets[1] + y * nv12.strides[1] + x * 2];
+                        same &= uv[0] == expected[i420.offsets[1] + y * i420.strides[1] + x];
+                        same &= uv[1] == expected[i420.offsets[2] + y * i420.strides[2] + x];
+                    }
+                }
+                CHECK(same);
+            }
+        }
+
+        THEN("converting with several threads gives the same samples") {
+            ssa::YuvConverter converter(ssa::YuvFormat::I420, 3);
+            CHECK(converter.threads() == 3);
+            for (unsigned i = 0; i < 3; ++i) {
+                CHECK(max_difference(convert(converter, frame, stride, width, height),
+                                     expected, width, height) == 0);
+            }
+        }
+    }
+
+    GIVEN("Gray pixels") {
+        std::vector<uint8_t> gray(16 * 4 * 2);
+        for (unsigned i = 0; i < gray.size(); ++i) {
+            gray[i] = i / 4 * 16;
+        }
+
+        THEN("they have no chroma and the full range maps to 16-235") {
+            for (auto kernel : kernels) {
+                ssa::YuvConverter converter(ssa::YuvFormat::I420, 1, kernel);
+                const auto yuv = convert(converter, gray, 16 * 4, 16, 2);
+                const ssa::YuvLayout layout = ssa::YuvLayout::compute(ssa::YuvFormat::I420, 16, 2);
+                CHECK((int) yuv[0] == 16);
+                for (unsigned x = 0; x < 8; ++x) {
+                    CHECK((int) yuv[layout.offsets[1] + x] == 128);
+                    CHECK((int) yuv[layout.offsets[2] + x] == 128);
+                }
+            }
+            std::vector<uint8_t> white(16 * 4 * 2, 255);
+            ssa::YuvConverter converter(ssa::YuvFormat::I420);
+            CHECK((int) convert(converter, white, 16 * 4, 16, 2)[0] == 235);
+        }
+    }
+}
+
+SCENARIO("test the YUV frame layouts", "[yuv-converter]") {
+    GIVEN("A width whose half is not a multiple of 4") {
+        const unsigned width = 1366, height = 768;
+
+        THEN("the I420 lines are padded like GStreamer does") {
+            const ssa::YuvLayout layout =
+                ssa::YuvLayout::compute(ssa::YuvFormat::I420, width, height);
+            CHECK(layout.strides[0] == 1368);
+            CHECK(layout.strides[1] == 684);
+            CHECK(layout.strides[2] == 684);
+            CHECK(layout.offsets[0] == 0);
+            CHECK(layout.offsets[1] == 1368 * 768);
+            CHECK(layout.offsets[2] == 1368 * 768 + 684 * 384);
+            CHECK(layout.size == 1368 * 768 + 2 * 684 * 384);
+        }
+
+        THEN("the NV12 chroma plane has the luma stride") {
+            const ssa::YuvLayout layout =
+                ssa::YuvLayout::compute(ssa::YuvFormat::NV12, width, height);
+            CHECK(layout.strides[0] == 1368);
+            CHECK(layout.strides[1] == 1368);
+            CHECK(layout.offsets[1] == 1368 * 768);
+            CHECK(layout.size == 1368 * 768 * 3 / 2);
+        }
+    }
+
+    GIVEN("A frame of odd size") {
+        const auto frame = random_frame(101 * 4, 50);
+        std::vector<uint8_t> yuv(ssa::YuvLayout::compute(ssa::YuvFormat::I420, 101, 50).size);
+        ssa::YuvConverter converter(ssa::YuvFormat::I420);
+
+        THEN("it cannot be converted") {
+            REQUIRE_THROWS_AS(converter.convert(frame.data(), 101 * 4, 101, 50, yuv.data()),
+                              ssa::Error);
+        }
+    }
+}
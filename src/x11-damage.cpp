@@ -0,0 +1,133 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/x11-damage.hpp>
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <atomic>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <X11/extensions/Xfixes.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+std::atomic<int> wakeup_fd(-1);
+
+int64_t monotonic_ms()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+} // namespace
+
+X11DamageTracker::X11DamageTracker(Display *display, Window window) :
+    display(display)
+{
+    int error_base;
+    if (!display || !XDamageQueryExtension(display, &damage_event_base, &error_base)) {
+        throw Error("XDamage extension is not available");
+    }
+
+    // only report the transition from an empty to a non empty damage,
+    // the accumulated region is fetched on demand by take_damage()
+    damage_handle = XDamageCreate(display, window, XDamageReportNonEmpty);
+    region = XFixesCreateRegion(display, nullptr, 0);
+    XFlush(display);
+}
+
+X11DamageTracker::~X11DamageTracker()
+{
+    XFixesDestroyRegion(display, region);
+    XDamageDestroy(display, damage_handle);
+    XFlush(display);
+}
+
+void X11DamageTracker::process_events()
+{
+    while (XPending(display)) {
+        XEvent event;
+        XNextEvent(display, &event);
+        if (event.type == damage_event_base + XDamageNotify) {
+            pending = true;
+        }
+    }
+}
+
+bool X11DamageTracker::damaged()
+{
+    process_events();
+    return pending;
+}
+
+bool X11DamageTracker::wait_for_damage(int timeout_ms)
+{
+    const int64_t deadline = monotonic_ms() + timeout_ms;
+
+    while (!damaged()) {
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            int64_t remaining = deadline - monotonic_ms();
+            if (remaining <= 0) {
+                return false;
+            }
+            wait_ms = (int) remaining;
+        }
+
+        struct pollfd pollfds[2] = {
+            {ConnectionNumber(display), POLLIN, 0},
+            {wakeup_fd, POLLIN, 0},
+        };
+        const nfds_t count = pollfds[1].fd >= 0 ? 2 : 1;
+        if (poll(pollfds, count, wait_ms) < 0) {
+            if (errno == EINTR) {
+                // the caller checks whether it has to quit
+                return damaged();
+            }
+            throw Error("poll failed on the X connection");
+        }
+        if (count == 2 && pollfds[1].revents) {
+            // a command is waiting, the caller handles it first
+            return damaged();
+        }
+    }
+    return true;
+}
+
+void X11DamageTracker::set_wakeup_fd(int fd)
+{
+    wakeup_fd = fd;
+}
+
+const std::vector<DamageRect> &X11DamageTracker::take_damage()
+{
+    process_events();
+
+    // move the accumulated damage into our region and clear it on the
+    // server side, any later change generates a new notify event
+    XDamageSubtract(display, damage_handle, None, region);
+    pending = false;
+
+    int count = 0;
+    XRectangle *area = XFixesFetchRegion(display, region, &count);
+    rects.clear();
+    for (int i = 0; i < count; ++i) {
+        rects.push_back({area[i].x, area[i].y, area[i].width, area[i].height});
+    }
+    if (area) {
+        XFree(area);
+    }
+
+    return rects;
+}
+
+}} // namespace spice::streaming_agent
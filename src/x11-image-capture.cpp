@@ -0,0 +1,155 @@
+/* \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/x11-image-capture.hpp>
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <mutex>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <syslog.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/* The error handler is process wide: captures attaching segments from
+ * several threads (the pool of the GStreamer plugin) would restore each
+ * other's handler and share the flag, the whole sequence is serialized.
+ */
+std::mutex shm_attach_mutex;
+// set by the error handler installed while attaching the shared memory segment
+bool shm_attach_failed = false;
+
+int shm_attach_error_handler(Display *, XErrorEvent *)
+{
+    shm_attach_failed = true;
+    return 0;
+}
+
+} // namespace
+
+X11ImageCapture::X11ImageCapture(Display *display, bool use_shm) :
+    display(display),
+    use_shm(use_shm)
+{
+    if (!display) {
+        throw Error("X11ImageCapture requires an open display");
+    }
+    if (use_shm && !XShmQueryExtension(display)) {
+        syslog(LOG_NOTICE, "MIT-SHM extension is not available, capturing with XGetImage");
+        this->use_shm = false;
+    }
+}
+
+X11ImageCapture::~X11ImageCapture()
+{
+    destroy_image();
+}
+
+bool X11ImageCapture::create_shm_image(Window window, unsigned width, unsigned height)
+{
+    XWindowAttributes win_info;
+    if (!XGetWindowAttributes(display, window, &win_info)) {
+        return false;
+    }
+
+    image = XShmCreateImage(display, win_info.visual, win_info.depth, ZPixmap, nullptr,
+                            &shm_info, width, height);
+    if (!image) {
+        return false;
+    }
+    image_is_shm = true;
+
+    shm_info.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+                            IPC_CREAT | 0600);
+    if (shm_info.shmid < 0) {
+        shm_info.shmaddr = nullptr;
+        destroy_image();
+        return false;
+    }
+
+    shm_info.shmaddr = image->data = (char *) shmat(shm_info.shmid, nullptr, 0);
+    // mark the segment for removal now, it stays around until both we and
+    // the X server detach from it, so it cannot leak if we crash
+    shmctl(shm_info.shmid, IPC_RMID, nullptr);
+    if (shm_info.shmaddr == (char *) -1) {
+        shm_info.shmaddr = image->data = nullptr;
+        destroy_image();
+        return false;
+    }
+    shm_info.readOnly = False;
+
+    // a remote X server accepts the extension query but fails the attach
+    // asynchronously, catch the error instead of letting Xlib abort
+    bool failed;
+    {
+        std::lock_guard<std::mutex> lock(shm_attach_mutex);
+        XSync(display, False);
+        shm_attach_failed = false;
+        XErrorHandler old_handler = XSetErrorHandler(shm_attach_error_handler);
+        Status attached = XShmAttach(display, &shm_info);
+        XSync(display, False);
+        XSetErrorHandler(old_handler);
+        failed = !attached || shm_attach_failed;
+    }
+
+    if (failed) {
+        shmdt(shm_info.shmaddr);
+        shm_info.shmaddr = image->data = nullptr;
+        destroy_image();
+        return false;
+    }
+
+    return true;
+}
+
+void X11ImageCapture::destroy_image()
+{
+    if (!image) {
+        return;
+    }
+
+    if (image_is_shm && image->data) {
+        XShmDetach(display, &shm_info);
+        XSync(display, False);
+        shmdt(shm_info.shmaddr);
+        // the data does not come from malloc, do not let Xlib free it
+        image->data = nullptr;
+    }
+    XDestroyImage(image);
+    image = nullptr;
+    image_is_shm = false;
+}
+
+XImage *X11ImageCapture::capture(Window window, int x, int y, unsigned width, unsigned height)
+{
+    if (use_shm) {
+        if (image && ((unsigned) image->width != width || (unsigned) image->height != height)) {
+            destroy_image();
+        }
+        if (!image && !create_shm_image(window, width, height)) {
+            syslog(LOG_WARNING, "Failed to set up a MIT-SHM segment, capturing with XGetImage");
+            use_shm = false;
+        } else if (XShmGetImage(display, window, image, x, y, AllPlanes)) {
+            return image;
+        } else {
+            syslog(LOG_WARNING, "XShmGetImage failed, capturing with XGetImage");
+            use_shm = false;
+            destroy_image();
+        }
+    }
+
+    destroy_image();
+    image = XGetImage(display, window, x, y, width, height, AllPlanes, ZPixmap);
+    if (!image) {
+        throw Error("Cannot capture from X");
+    }
+    return image;
+}
+
+}} // namespace spice::streaming_agent
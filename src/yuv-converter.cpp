@@ -0,0 +1,414 @@
+/* Conversion of captured frames to the YUV formats of the video encoders.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <spice-streaming-agent/yuv-converter.hpp>
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUV_CONVERTER_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/*
+ * BT.601 limited range, the coefficients scaled by 2^15:
+ *     Y = 16 + 0.256788 R + 0.504129 G + 0.097906 B
+ *     U = 128 - 0.148223 R - 0.290993 G + 0.439216 B
+ *     V = 128 + 0.439216 R - 0.367788 G - 0.071427 B
+ * The chroma coefficients of each row add up to 0 so that the grays have
+ * no chroma. The chroma is computed from the sums of 2x2 pixels, hence
+ * the 2 more bits of shift.
+ */
+const int y_r = 8414, y_g = 16519, y_b = 3208;
+const int u_r = -4857, u_g = -9535, u_b = 14392;
+const int v_r = 14392, v_g = -12052, v_b = -2340;
+const int y_offset = (16 << 15) + (1 << 14);
+const int c_offset = (128 << 17) + (1 << 16);
+
+/*
+ * Converts the pixels from x to width of a pair of lines, writing two lines
+ * of luma and a line of chroma. With interleaved chroma (NV12) u and v
+ * point to the same line, shifted by one byte.
+ */
+typedef unsigned LinePairFunction(const uint8_t *top, const uint8_t *bottom, unsigned width,
+                                  uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v,
+                                  bool interleaved);
+
+inline uint8_t luma(const uint8_t *p)
+{
+    return (y_r * p[2] + y_g * p[1] + y_b * p[0] + y_offset) >> 15;
+}
+
+void convert_pairs_scalar(const uint8_t *top, const uint8_t *bottom, unsigned x, unsigned width,
+                          uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v,
+                          bool interleaved)
+{
+    const unsigned step = interleaved ? 2 : 1;
+    for (; x < width; x += 2) {
+        const uint8_t *a = top + x * 4, *b = a + 4, *c = bottom + x * 4, *d = c + 4;
+        y_top[x] = luma(a);
+        y_top[x + 1] = luma(b);
+        y_bottom[x] = luma(c);
+        y_bottom[x + 1] = luma(d);
+
+        const int blue = a[0] + b[0] + c[0] + d[0];
+        const int green = a[1] + b[1] + c[1] + d[1];
+        const int red = a[2] + b[2] + c[2] + d[2];
+        u[x / 2 * step] = (u_r * red + u_g * green + u_b * blue + c_offset) >> 17;
+        v[x / 2 * step] = (v_r * red + v_g * green + v_b * blue + c_offset) >> 17;
+    }
+}
+
+unsigned convert_pairs_scalar(const uint8_t *top, const uint8_t *bottom, unsigned width,
+                              uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v,
+                              bool interleaved)
+{
+    convert_pairs_scalar(top, bottom, 0, width, y_top, y_bottom, u, v, interleaved);
+    return width;
+}
+
+#if YUV_CONVERTER_X86
+/*
+ * The pixels are widened to 16 bits (blue, green, red, padding) and
+ * multiplied by (b, g, r, 0) coefficients with pmaddwd, which leaves two
+ * 32 bits halves per pixel, added by pairs.
+ */
+__attribute__((target("sse2")))
+inline __m128i dot4_sse2(__m128i first, __m128i second, __m128i coefficients)
+{
+    const __m128 a = _mm_castsi128_ps(_mm_madd_epi16(first, coefficients));
+    const __m128 b = _mm_castsi128_ps(_mm_madd_epi16(second, coefficients));
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                         _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// the sums of the 2x2 blocks of the 2 pixels of top and bottom, in the low half
+__attribute__((target("sse2")))
+inline __m128i block_sum_sse2(__m128i top, __m128i bottom)
+{
+    const __m128i sum = _mm_add_epi16(top, bottom);
+    return _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+}
+
+__attribute__((target("sse2")))
+inline __m128i coefficients_sse2(int b, int g, int r)
+{
+    return _mm_setr_epi16(b, g, r, 0, b, g, r, 0);
+}
+
+__attribute__((target("sse2")))
+unsigned convert_pairs_sse2(const uint8_t *top, const uint8_t *bottom, unsigned width,
+                            uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v,
+                            bool interleaved)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i y_coefficients = coefficients_sse2(y_b, y_g, y_r);
+    const __m128i u_coefficients = coefficients_sse2(u_b, u_g, u_r);
+    const __m128i v_coefficients = coefficients_sse2(v_b, v_g, v_r);
+    const __m128i y_offsets = _mm_set1_epi32(y_offset);
+    const __m128i c_offsets = _mm_set1_epi32(c_offset);
+
+    // 8 pixels of each line, 4 chroma samples
+    const unsigned blocks = width / 8;
+    for (unsigned i = 0; i < blocks; ++i) {
+        __m128i pixels[2][4];
+        const uint8_t *lines[2] = { top + i * 32, bottom + i * 32 };
+        uint8_t *luma_lines[2] = { y_top + i * 8, y_bottom + i * 8 };
+        for (unsigned line = 0; line < 2; ++line) {
+            const __m128i p0 = _mm_loadu_si128((const __m128i *) lines[line]);
+            const __m128i p1 = _mm_loadu_si128((const __m128i *) (lines[line] + 16));
+            __m128i *wide = pixels[line];
+            wide[0] = _mm_unpacklo_epi8(p0, zero);
+            wide[1] = _mm_unpackhi_epi8(p0, zero);
+            wide[2] = _mm_unpacklo_epi8(p1, zero);
+            wide[3] = _mm_unpackhi_epi8(p1, zero);
+
+            const __m128i y0 = _mm_srai_epi32(
+                _mm_add_epi32(dot4_sse2(wide[0], wide[1], y_coefficients), y_offsets), 15);
+            const __m128i y1 = _mm_srai_epi32(
+                _mm_add_epi32(dot4_sse2(wide[2], wide[3], y_coefficients), y_offsets), 15);
+            const __m128i y16 = _mm_packs_epi32(y0, y1);
+            _mm_storel_epi64((__m128i *) luma_lines[line], _mm_packus_epi16(y16, y16));
+        }
+
+        const __m128i sums01 = _mm_unpacklo_epi64(block_sum_sse2(pixels[0][0], pixels[1][0]),
+                                                  block_sum_sse2(pixels[0][1], pixels[1][1]));
+        const __m128i sums23 = _mm_unpacklo_epi64(block_sum_sse2(pixels[0][2], pixels[1][2]),
+                                                  block_sum_sse2(pixels[0][3], pixels[1][3]));
+        const __m128i u32 = _mm_srai_epi32(
+            _mm_add_epi32(dot4_sse2(sums01, sums23, u_coefficients), c_offsets), 17);
+        const __m128i v32 = _mm_srai_epi32(
+            _mm_add_epi32(dot4_sse2(sums01, sums23, v_coefficients), c_offsets), 17);
+        const __m128i uv16 = _mm_packs_epi32(u32, v32);
+        // u0-u3, v0-v3
+        const __m128i uv = _mm_packus_epi16(uv16, uv16);
+        if (interleaved) {
+            _mm_storel_epi64((__m128i *) (u + i * 8),
+                             _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 4)));
+        } else {
+            const uint32_t u4 = _mm_cvtsi128_si32(uv);
+            const uint32_t v4 = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+            memcpy(u + i * 4, &u4, 4);
+            memcpy(v + i * 4, &v4, 4);
+        }
+    }
+    return blocks * 8;
+}
+
+// dot4_sse2 on each 128 bits lane
+__attribute__((target("avx2")))
+inline __m256i dot4_avx2(__m256i first, __m256i second, __m256i coefficients)
+{
+    const __m256 a = _mm256_castsi256_ps(_mm256_madd_epi16(first, coefficients));
+    const __m256 b = _mm256_castsi256_ps(_mm256_madd_epi16(second, coefficients));
+    return _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                            _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+__attribute__((target("avx2")))
+inline __m256i block_sum_avx2(__m256i top, __m256i bottom)
+{
+    const __m256i sum = _mm256_add_epi16(top, bottom);
+    return _mm256_add_epi16(sum, _mm256_srli_si256(sum, 8));
+}
+
+__attribute__((target("avx2")))
+inline __m256i coefficients_avx2(int b, int g, int r)
+{
+    return _mm256_setr_epi16(b, g, r, 0, b, g, r, 0, b, g, r, 0, b, g, r, 0);
+}
+
+/*
+ * The same computation as the SSE2 kernel on 16 pixels. The unpacks work
+ * on each 128 bits lane: pixels 0-1 and 4-5 are in the low halves, the
+ * results are put back in order with permutes.
+ */
+__attribute__((target("avx2")))
+unsigned convert_pairs_avx2(const uint8_t *top, const uint8_t *bottom, unsigned width,
+                            uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v,
+                            bool interleaved)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i y_coefficients = coefficients_avx2(y_b, y_g, y_r);
+    const __m256i u_coefficients = coefficients_avx2(u_b, u_g, u_r);
+    const __m256i v_coefficients = coefficients_avx2(v_b, v_g, v_r);
+    const __m256i y_offsets = _mm256_set1_epi32(y_offset);
+    const __m256i c_offsets = _mm256_set1_epi32(c_offset);
+    // chroma samples 0, 1, 4, 5, 2, 3, 6, 7 back in order
+    const __m256i chroma_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+    // 16 pixels of each line, 8 chroma samples
+    const unsigned blocks = width / 16;
+    for (unsigned i = 0; i < blocks; ++i) {
+        __m256i pixels[2][4];
+        const uint8_t *lines[2] = { top + i * 64, bottom + i * 64 };
+        uint8_t *luma_lines[2] = { y_top + i * 16, y_bottom + i * 16 };
+        for (unsigned line = 0; line < 2; ++line) {
+            const __m256i p0 = _mm256_loadu_si256((const __m256i *) lines[line]);
+            const __m256i p1 = _mm256_loadu_si256((const __m256i *) (lines[line] + 32));
+            __m256i *wide = pixels[line];
+            wide[0] = _mm256_unpacklo_epi8(p0, zero);
+            wide[1] = _mm256_unpackhi_epi8(p0, zero);
+            wide[2] = _mm256_unpacklo_epi8(p1, zero);
+            wide[3] = _mm256_unpackhi_epi8(p1, zero);
+
+            // pixels 0-7 and 8-15
+            const __m256i y0 = _mm256_srai_epi32(
+                _mm256_add_epi32(dot4_avx2(wide[0], wide[1], y_coefficients), y_offsets), 15);
+            const __m256i y1 = _mm256_srai_epi32(
+                _mm256_add_epi32(dot4_avx2(wide[2], wide[3], y_coefficients), y_offsets), 15);
+            const __m256i y16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(y0, y1),
+                                                         _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i *) luma_lines[line],
+                             _mm_packus_epi16(_mm256_castsi256_si128(y16),
+                                              _mm256_extracti128_si256(y16, 1)));
+        }
+
+        // blocks 0-1 and 2-3, then 4-5 and 6-7
+        const __m256i sums0 = _mm256_unpacklo_epi64(block_sum_avx2(pixels[0][0], pixels[1][0]),
+                                                    block_sum_avx2(pixels[0][1], pixels[1][1]));
+        const __m256i sums1 = _mm256_unpacklo_epi64(block_sum_avx2(pixels[0][2], pixels[1][2]),
+                                                    block_sum_avx2(pixels[0][3], pixels[1][3]));
+        const __m256i u32 = _mm256_permutevar8x32_epi32(_mm256_srai_epi32(
+            _mm256_add_epi32(dot4_avx2(sums0, sums1, u_coefficients), c_offsets), 17), chroma_order);
+        const __m256i v32 = _mm256_permutevar8x32_epi32(_mm256_srai_epi32(
+            _mm256_add_epi32(dot4_avx2(sums0, sums1, v_coefficients), c_offsets), 17), chroma_order);
+        const __m256i uv16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(u32, v32),
+                                                      _MM_SHUFFLE(3, 1, 2, 0));
+        // u0-u7, v0-v7
+        const __m128i uv = _mm_packus_epi16(_mm256_castsi256_si128(uv16),
+                                            _mm256_extracti128_si256(uv16, 1));
+        if (interleaved) {
+            _mm_storeu_si128((__m128i *) (u + i * 16),
+                             _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+        } else {
+            _mm_storel_epi64((__m128i *) (u + i * 8), uv);
+            _mm_storel_epi64((__m128i *) (v + i * 8), _mm_srli_si128(uv, 8));
+        }
+    }
+    return blocks * 16;
+}
+#endif
+
+LinePairFunction *kernel_function(SimdLevel kernel)
+{
+    switch (kernel) {
+#if YUV_CONVERTER_X86
+    case SimdLevel::AVX2:
+        return convert_pairs_avx2;
+    case SimdLevel::SSE2:
+        return convert_pairs_sse2;
+#endif
+    default:
+        return convert_pairs_scalar;
+    }
+}
+
+inline size_t round_up_4(size_t value)
+{
+    return (value + 3) & ~size_t(3);
+}
+
+} // namespace
+
+YuvLayout YuvLayout::compute(YuvFormat format, unsigned width, unsigned height)
+{
+    const size_t chroma_height = (height + 1) / 2;
+    YuvLayout layout = {};
+    layout.strides[0] = round_up_4(width);
+    layout.offsets[1] = layout.strides[0] * (chroma_height * 2);
+    if (format == YuvFormat::NV12) {
+        layout.strides[1] = layout.strides[0];
+        layout.size = layout.offsets[1] + layout.strides[1] * chroma_height;
+    } else {
+        layout.strides[1] = layout.strides[2] = round_up_4((width + 1) / 2);
+        layout.offsets[2] = layout.offsets[1] + layout.strides[1] * chroma_height;
+        layout.size = layout.offsets[2] + layout.strides[2] * chroma_height;
+    }
+    return layout;
+}
+
+SimdLevel YuvConverter::supported_kernel(SimdLevel kernel)
+{
+    return select_simd_level(kernel, {SimdLevel::SSE2, SimdLevel::AVX2});
+}
+
+YuvConverter::YuvConverter(YuvFormat format, unsigned threads, SimdLevel kernel) :
+    yuv_format(format),
+    kernel_used(supported_kernel(kernel)),
+    next_band(0)
+{
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back(&YuvConverter::worker, this);
+    }
+}
+
+YuvConverter::~YuvConverter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cond.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void YuvConverter::worker()
+{
+    uint64_t done_generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cond.wait(lock, [&] { return stopping || generation != done_generation; });
+            if (stopping) {
+                return;
+            }
+            done_generation = generation;
+        }
+
+        convert_bands();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_workers == 0) {
+            done_cond.notify_one();
+        }
+    }
+}
+
+void YuvConverter::convert_bands()
+{
+    LinePairFunction *convert_pairs = kernel_function(kernel_used);
+    const bool interleaved = yuv_format == YuvFormat::NV12;
+    const unsigned pairs = height / 2;
+    for (;;) {
+        const unsigned band = next_band++;
+        if (band >= bands) {
+            return;
+        }
+        const unsigned end = (band + 1) * pairs / bands;
+        for (unsigned pair = band * pairs / bands; pair < end; ++pair) {
+            const uint8_t *top = src + pair * 2 * stride;
+            uint8_t *y_top = dst + pair * 2 * layout.strides[0];
+            uint8_t *u = dst + layout.offsets[1] + pair * layout.strides[1];
+            uint8_t *v = interleaved ? u + 1 : dst + layout.offsets[2] + pair * layout.strides[2];
+
+            const unsigned done = convert_pairs(top, top + stride, width, y_top,
+                                                y_top + layout.strides[0], u, v, interleaved);
+            convert_pairs_scalar(top, top + stride, done, width, y_top,
+                                 y_top + layout.strides[0], u, v, interleaved);
+        }
+    }
+}
+
+void YuvConverter::convert(const uint8_t *src, size_t stride, unsigned width, unsigned height,
+                           uint8_t *dst)
+{
+    if (width % 2 || height % 2) {
+        throw Error("Cannot convert a " + std::to_string(width) + "x" +
+                    std::to_string(height) + " frame to YUV 4:2:0, the size must be even");
+    }
+
+    this->src = src;
+    this->stride = stride;
+    this->width = width;
+    this->height = height;
+    this->dst = dst;
+    layout = YuvLayout::compute(yuv_format, width, height);
+    bands = std::min(threads(), height / 2);
+    next_band = 0;
+
+    if (workers.empty()) {
+        convert_bands();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++generation;
+        busy_workers = workers.size();
+    }
+    start_cond.notify_all();
+
+    // the calling thread converts bands too
+    convert_bands();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cond.wait(lock, [this] { return busy_workers == 0; });
+}
+
+}} // namespace spice::streaming_agent